@@ -40,3 +40,12 @@ with pg.Connection(connection_string) as conn:
     conn.start_copy_in("COPY cja.one FROM STDIN")
     conn.write_copy_data("1\n2\n")
     conn.end_copy()
+
+    # wait for notifications without polling the server
+    conn.execute("LISTEN cache_invalidation")
+    for channel, pid, payload in conn.notifications(5.0):
+        print(channel, payload)
+
+    # or, from asyncio, receive notifications in batches as they arrive
+    # async for batch in conn.notification_stream():
+    #     ...
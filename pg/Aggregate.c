@@ -0,0 +1,423 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <libpq-fe.h>
+#include <stdint.h>
+#include "decode.h"
+
+// defined in Lookup.c
+PyObject* Lookup_value(const PGresult* res, int column, const char* value, int length);
+
+// group-by aggregation of a stream of rows, used by ForwardCursor.aggregate.
+// rows are added without the Python API (so the GIL can be released while the stream is read),
+// groups live in an open-addressing hash table keyed on the raw bytes of the group columns.
+// Python objects are only created for the result, one per group and output column
+
+enum { SUM_INT, SUM_FLOAT };
+enum { AGGREGATE_VALUE_ERROR, AGGREGATE_OVERFLOW, AGGREGATE_NO_MEMORY };
+
+typedef union {
+    int64_t i;
+    double f;
+} Sum;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t group;     // index of the group plus one, zero for an empty slot
+} AggregateSlot;
+
+typedef struct Aggregate {
+    int group_count;        // number of group by columns
+    int* group_columns;
+    int sum_count;          // number of summed columns
+    int* sum_columns;
+    int* sum_kinds;         // SUM_INT or SUM_FLOAT
+    int counts;             // whether to count the rows of each group
+
+    AggregateSlot* slots;
+    size_t capacity;        // number of slots, a power of two
+
+    size_t groups;
+    size_t groups_allocated;
+    size_t* key_offsets;    // start of each group's key in keys
+    size_t* key_lengths;
+    Sum* sums;              // sum_count per group
+    uint8_t* sum_seen;      // whether a group had any non-NULL value, sum_count per group
+    int64_t* row_counts;
+
+    char* keys;             // the keys of every group, one after another
+    size_t keys_length;
+    size_t keys_allocated;
+
+    char* row_key;          // the key of the row being added
+    size_t row_key_allocated;
+
+    int error_kind;         // why Aggregate_add_rows failed
+    char error[160];
+} Aggregate;
+
+void Aggregate_free(Aggregate* agg) {
+    if (agg == NULL)
+        return;
+    PyMem_RawFree(agg->group_columns);
+    PyMem_RawFree(agg->sum_columns);
+    PyMem_RawFree(agg->sum_kinds);
+    PyMem_RawFree(agg->slots);
+    PyMem_RawFree(agg->key_offsets);
+    PyMem_RawFree(agg->key_lengths);
+    PyMem_RawFree(agg->sums);
+    PyMem_RawFree(agg->sum_seen);
+    PyMem_RawFree(agg->row_counts);
+    PyMem_RawFree(agg->keys);
+    PyMem_RawFree(agg->row_key);
+    PyMem_RawFree(agg);
+}
+
+// res describes the columns, sums of integer columns stay exact, everything else is summed as a double.
+// raises ValueError for a column that cannot be summed
+Aggregate* Aggregate_new(const PGresult* res, const int* group_columns, int group_count, const int* sum_columns, int sum_count, int counts) {
+    for (int i = 0; i < sum_count; i++) {
+        int column = sum_columns[i];
+        Oid type = PQftype(res, column);
+        if (PQfformat(res, column) && type != 20 && type != 21 && type != 23 && type != 700 && type != 701) {
+            PyErr_Format(PyExc_ValueError, "Cannot sum binary column '%s' of Oid type %i.", PQfname(res, column), type);
+            return NULL;
+        }
+    }
+
+    Aggregate* agg = (Aggregate*)PyMem_RawCalloc(1, sizeof(Aggregate));
+    if (agg == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    agg->group_count = group_count;
+    agg->sum_count = sum_count;
+    agg->counts = counts;
+    agg->capacity = 1024;
+    agg->group_columns = (int*)PyMem_RawMalloc(sizeof(int) * (group_count + 1));
+    agg->sum_columns = (int*)PyMem_RawMalloc(sizeof(int) * (sum_count + 1));
+    agg->sum_kinds = (int*)PyMem_RawMalloc(sizeof(int) * (sum_count + 1));
+    agg->slots = (AggregateSlot*)PyMem_RawCalloc(agg->capacity, sizeof(AggregateSlot));
+    if (agg->group_columns == NULL || agg->sum_columns == NULL || agg->sum_kinds == NULL || agg->slots == NULL) {
+        Aggregate_free(agg);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memcpy(agg->group_columns, group_columns, sizeof(int) * group_count);
+    memcpy(agg->sum_columns, sum_columns, sizeof(int) * sum_count);
+    for (int i = 0; i < sum_count; i++) {
+        Oid type = PQftype(res, sum_columns[i]);
+        agg->sum_kinds[i] = (type == 20 || type == 21 || type == 23) ? SUM_INT : SUM_FLOAT;
+    }
+    return agg;
+}
+
+static uint64_t Aggregate_hash(const char* key, size_t length) {
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ length;
+    uint64_t k;
+    while (length >= 8) {
+        memcpy(&k, key, 8);
+        h = (h ^ k) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+        key += 8;
+        length -= 8;
+    }
+    k = 0;
+    memcpy(&k, key, length);
+    h = (h ^ k) * 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 29;
+    h *= 0xff51afd7ed558ccdull;
+    return h ^ (h >> 32);
+}
+
+// grows buffer to hold at least needed bytes, returns -1 if out of memory
+static int Aggregate_reserve(char** buffer, size_t* allocated, size_t needed) {
+    if (needed <= *allocated)
+        return 0;
+    size_t size = *allocated ? *allocated : 64;
+    while (size < needed)
+        size *= 2;
+    char* grown = (char*)PyMem_RawRealloc(*buffer, size);
+    if (grown == NULL)
+        return -1;
+    *buffer = grown;
+    *allocated = size;
+    return 0;
+}
+
+// doubles the hash table, the hashes are kept in the slots so the keys are not read again
+static int Aggregate_grow(Aggregate* agg) {
+    size_t capacity = agg->capacity * 2;
+    AggregateSlot* slots = (AggregateSlot*)PyMem_RawCalloc(capacity, sizeof(AggregateSlot));
+    if (slots == NULL)
+        return -1;
+    for (size_t i = 0; i < agg->capacity; i++) {
+        AggregateSlot slot = agg->slots[i];
+        if (slot.group == 0)
+            continue;
+        size_t index = slot.hash & (capacity - 1);
+        while (slots[index].group != 0)
+            index = (index + 1) & (capacity - 1);
+        slots[index] = slot;
+    }
+    PyMem_RawFree(agg->slots);
+    agg->slots = slots;
+    agg->capacity = capacity;
+    return 0;
+}
+
+// adds a group for the key in row_key, returns its index or -1 if out of memory
+static int64_t Aggregate_add_group(Aggregate* agg, size_t length) {
+    size_t group = agg->groups;
+    if (group >= UINT32_MAX - 1)
+        return -1;
+    if (group == agg->groups_allocated) {
+        size_t allocated = agg->groups_allocated ? agg->groups_allocated * 2 : 256;
+        size_t sums = allocated * (agg->sum_count ? agg->sum_count : 1);
+        size_t* key_offsets = (size_t*)PyMem_RawRealloc(agg->key_offsets, allocated * sizeof(size_t));
+        if (key_offsets == NULL)
+            return -1;
+        agg->key_offsets = key_offsets;
+        size_t* key_lengths = (size_t*)PyMem_RawRealloc(agg->key_lengths, allocated * sizeof(size_t));
+        if (key_lengths == NULL)
+            return -1;
+        agg->key_lengths = key_lengths;
+        Sum* sum_values = (Sum*)PyMem_RawRealloc(agg->sums, sums * sizeof(Sum));
+        if (sum_values == NULL)
+            return -1;
+        agg->sums = sum_values;
+        uint8_t* sum_seen = (uint8_t*)PyMem_RawRealloc(agg->sum_seen, sums);
+        if (sum_seen == NULL)
+            return -1;
+        agg->sum_seen = sum_seen;
+        int64_t* row_counts = (int64_t*)PyMem_RawRealloc(agg->row_counts, allocated * sizeof(int64_t));
+        if (row_counts == NULL)
+            return -1;
+        agg->row_counts = row_counts;
+        agg->groups_allocated = allocated;
+    }
+    if (Aggregate_reserve(&agg->keys, &agg->keys_allocated, agg->keys_length + length) < 0)
+        return -1;
+    memcpy(agg->keys + agg->keys_length, agg->row_key, length);
+    agg->key_offsets[group] = agg->keys_length;
+    agg->key_lengths[group] = length;
+    agg->keys_length += length;
+    memset(agg->sums + group * agg->sum_count, 0, sizeof(Sum) * agg->sum_count);
+    memset(agg->sum_seen + group * agg->sum_count, 0, agg->sum_count);
+    agg->row_counts[group] = 0;
+    agg->groups++;
+    return group;
+}
+
+// finds or adds the group of the key in row_key
+static int64_t Aggregate_find_group(Aggregate* agg, size_t length) {
+    uint64_t hash = Aggregate_hash(agg->row_key, length);
+    size_t mask = agg->capacity - 1;
+    size_t index = hash & mask;
+    for (;;) {
+        AggregateSlot* slot = &agg->slots[index];
+        if (slot->group == 0)
+            break;
+        size_t group = slot->group - 1;
+        if (slot->hash == hash && agg->key_lengths[group] == length
+            && memcmp(agg->keys + agg->key_offsets[group], agg->row_key, length) == 0)
+            return group;
+        index = (index + 1) & mask;
+    }
+
+    int64_t group = Aggregate_add_group(agg, length);
+    if (group < 0)
+        return -1;
+    agg->slots[index].hash = hash;
+    agg->slots[index].group = (uint32_t)group + 1;
+    // keep the load factor under 3/4
+    if (agg->groups * 4 >= agg->capacity * 3 && Aggregate_grow(agg) < 0)
+        return -1;
+    return group;
+}
+
+// adds every row of res, does not use the Python API. Returns -1 on error, see Aggregate_set_error
+int Aggregate_add_rows(Aggregate* agg, const PGresult* res) {
+    int rows = PQntuples(res);
+    for (int row = 0; row < rows; row++) {
+        // the key is the length (-1 for NULL) and bytes of each group column
+        size_t length = 0;
+        for (int i = 0; i < agg->group_count; i++) {
+            int column = agg->group_columns[i];
+            int32_t value_length = PQgetisnull(res, row, column) ? -1 : PQgetlength(res, row, column);
+            size_t needed = length + sizeof(int32_t) + (value_length > 0 ? value_length : 0);
+            if (Aggregate_reserve(&agg->row_key, &agg->row_key_allocated, needed) < 0)
+                goto out_of_memory;
+            memcpy(agg->row_key + length, &value_length, sizeof(int32_t));
+            length += sizeof(int32_t);
+            if (value_length > 0) {
+                memcpy(agg->row_key + length, PQgetvalue(res, row, column), value_length);
+                length += value_length;
+            }
+        }
+
+        int64_t group = Aggregate_find_group(agg, length);
+        if (group < 0)
+            goto out_of_memory;
+        agg->row_counts[group]++;
+
+        Sum* sums = agg->sums + group * agg->sum_count;
+        uint8_t* seen = agg->sum_seen + group * agg->sum_count;
+        for (int i = 0; i < agg->sum_count; i++) {
+            int column = agg->sum_columns[i];
+            // like SQL, NULLs are left out of the sum
+            if (PQgetisnull(res, row, column))
+                continue;
+            const char* value = PQgetvalue(res, row, column);
+            int value_length = PQgetlength(res, row, column);
+            if (agg->sum_kinds[i] == SUM_INT) {
+                int64_t n;
+                if (PQfformat(res, column)) {
+                    switch (PQftype(res, column)) {
+                        case 21: n = decode_int2(value); break;
+                        case 23: n = decode_int4(value); break;
+                        default: n = decode_int8(value); break;
+                    }
+                } else if (parse_int64(value, value_length, &n) < 0) {
+                    agg->error_kind = AGGREGATE_VALUE_ERROR;
+                    snprintf(agg->error, sizeof(agg->error), "Cannot read '%.64s' as int.", value);
+                    return -1;
+                }
+                if (__builtin_add_overflow(sums[i].i, n, &sums[i].i)) {
+                    agg->error_kind = AGGREGATE_OVERFLOW;
+                    snprintf(agg->error, sizeof(agg->error), "The sum of column '%.64s' is out of range of a 64-bit integer.", PQfname(res, column));
+                    return -1;
+                }
+            } else {
+                double x;
+                if (PQfformat(res, column)) {
+                    x = PQftype(res, column) == 700 ? decode_float4(value) : decode_float8(value);
+                } else if (parse_float8(value, value_length, &x) < 0) {
+                    agg->error_kind = AGGREGATE_VALUE_ERROR;
+                    snprintf(agg->error, sizeof(agg->error), "Cannot read '%.64s' as float.", value);
+                    return -1;
+                }
+                sums[i].f += x;
+            }
+            seen[i] = 1;
+        }
+    }
+    return 0;
+
+out_of_memory:
+    agg->error_kind = AGGREGATE_NO_MEMORY;
+    return -1;
+}
+
+// raises the exception for a failed Aggregate_add_rows
+void Aggregate_set_error(Aggregate* agg) {
+    if (agg->error_kind == AGGREGATE_NO_MEMORY)
+        PyErr_NoMemory();
+    else
+        PyErr_SetString(agg->error_kind == AGGREGATE_OVERFLOW ? PyExc_OverflowError : PyExc_ValueError, agg->error);
+}
+
+// adds an output column (stealing list), raises ValueError if the name is already taken
+static int Aggregate_add_column(PyObject* result, PyObject* name, PyObject* list) {
+    if (list == NULL)
+        return -1;
+    int found = PyDict_Contains(result, name);
+    if (found == 0) {
+        found = PyDict_SetItem(result, name, list);
+    } else if (found > 0) {
+        PyErr_Format(PyExc_ValueError, "column '%U' appears more than once in the result", name);
+        found = -1;
+    }
+    Py_DECREF(list);
+    return found;
+}
+
+// the groups in the order they were first seen, as a dict of column name to list of values:
+// the group by columns, then the sums (None for a group with only NULLs) then 'count' if counts were requested
+PyObject* Aggregate_result(Aggregate* agg, const PGresult* res) {
+    Py_ssize_t groups = (Py_ssize_t)agg->groups;
+    PyObject* result = PyDict_New();
+    if (result == NULL)
+        return NULL;
+
+    for (int i = 0; i < agg->group_count; i++) {
+        int column = agg->group_columns[i];
+        PyObject* list = PyList_New(groups);
+        if (list == NULL)
+            goto error;
+        for (Py_ssize_t g = 0; g < groups; g++) {
+            // skip the earlier columns of the key
+            const char* key = agg->keys + agg->key_offsets[g];
+            int32_t length;
+            for (int k = 0;; k++) {
+                memcpy(&length, key, sizeof(int32_t));
+                key += sizeof(int32_t);
+                if (k == i)
+                    break;
+                if (length > 0)
+                    key += length;
+            }
+            PyObject* value = length < 0 ? Py_NewRef(Py_None) : Lookup_value(res, column, key, length);
+            if (value == NULL) {
+                Py_DECREF(list);
+                goto error;
+            }
+            PyList_SET_ITEM(list, g, value);
+        }
+        PyObject* name = PyUnicode_FromString(PQfname(res, column));
+        int added = name != NULL ? Aggregate_add_column(result, name, list) : (Py_DECREF(list), -1);
+        Py_XDECREF(name);
+        if (added < 0)
+            goto error;
+    }
+
+    for (int i = 0; i < agg->sum_count; i++) {
+        PyObject* list = PyList_New(groups);
+        if (list == NULL)
+            goto error;
+        for (Py_ssize_t g = 0; g < groups; g++) {
+            Sum sum = agg->sums[g * agg->sum_count + i];
+            PyObject* value;
+            if (!agg->sum_seen[g * agg->sum_count + i]) {
+                value = Py_NewRef(Py_None);
+            } else if (agg->sum_kinds[i] == SUM_INT) {
+                value = PyLong_FromLongLong(sum.i);
+            } else {
+                value = PyFloat_FromDouble(sum.f);
+            }
+            if (value == NULL) {
+                Py_DECREF(list);
+                goto error;
+            }
+            PyList_SET_ITEM(list, g, value);
+        }
+        PyObject* name = PyUnicode_FromString(PQfname(res, agg->sum_columns[i]));
+        int added = name != NULL ? Aggregate_add_column(result, name, list) : (Py_DECREF(list), -1);
+        Py_XDECREF(name);
+        if (added < 0)
+            goto error;
+    }
+
+    if (agg->counts) {
+        PyObject* list = PyList_New(groups);
+        if (list == NULL)
+            goto error;
+        for (Py_ssize_t g = 0; g < groups; g++) {
+            PyObject* value = PyLong_FromLongLong(agg->row_counts[g]);
+            if (value == NULL) {
+                Py_DECREF(list);
+                goto error;
+            }
+            PyList_SET_ITEM(list, g, value);
+        }
+        PyObject* name = PyUnicode_FromString("count");
+        int added = name != NULL ? Aggregate_add_column(result, name, list) : (Py_DECREF(list), -1);
+        Py_XDECREF(name);
+        if (added < 0)
+            goto error;
+    }
+    return result;
+
+error:
+    Py_DECREF(result);
+    return NULL;
+}
@@ -0,0 +1,742 @@
+#include "module.h"
+#include <libpq-fe.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "arrow_c.h"
+#include "decode.h"
+
+int ForwardCursor_advance(PyObject* cursor);
+PGresult* ForwardCursor_result(PyObject* cursor);
+const char* ForwardCursor_error_message(PyObject* cursor);
+void ForwardCursor_set_error(PyObject* cursor);
+ConnectionLock* ForwardCursor_lock(PyObject* cursor);
+int ForwardCursor_begin_consuming(PyObject* cursor);
+void ForwardCursor_end_consuming(PyObject* cursor);
+int DataTable_row_count(PyObject* table);
+int DataTable_is_spilled(PyObject* table);
+PGresult* DataTable_page(PyObject* table, int first_row, int rows);
+int find_keyword(PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames, const char* const* allowed, const char* name, PyObject** value);
+
+// how a PostgreSQL column is exported to Arrow
+typedef struct {
+    char* name;
+    const char* format;     // Arrow format string
+    int binary;             // result format of the column, see PQfformat
+    int width;              // bytes per value of fixed-width types, zero for bool and variable-length types
+} ArrowColumn;
+
+// buffers for one column of the batch being built
+typedef struct {
+    uint8_t* validity;
+    uint8_t* data;
+    int32_t* offsets;       // variable-length types only
+    int64_t length;
+    int64_t capacity;       // rows allocated in validity, data and offsets
+    int64_t data_size;      // bytes used in data by variable-length types
+    int64_t data_capacity;
+    int64_t null_count;
+} ArrowBuilder;
+
+static void arrow_column_init(ArrowColumn* col, const PGresult* res, int column) {
+    col->name = strdup(PQfname(res, column));
+    col->binary = PQfformat(res, column);
+    col->width = 0;
+    switch (PQftype(res, column)) {
+        case 16: // BOOL
+            col->format = "b";
+            break;
+        case 21: // INT2
+            col->format = "s";
+            col->width = 2;
+            break;
+        case 23: // INT4
+            col->format = "i";
+            col->width = 4;
+            break;
+        case 20: // INT8
+            col->format = "l";
+            col->width = 8;
+            break;
+        case 700: // FLOAT4
+            col->format = "f";
+            col->width = 4;
+            break;
+        case 701: // FLOAT8
+            col->format = "g";
+            col->width = 8;
+            break;
+        case 19: // NAME
+        case 25: // TEXT
+        case 1042: // BPCHAR
+        case 1043: // VARCHAR
+            col->format = "u";
+            break;
+        default:
+            // everything else is exported as its text, or as raw bytes when the result is binary
+            col->format = col->binary ? "z" : "u";
+            break;
+    }
+}
+
+static int arrow_builder_reserve(ArrowBuilder* b, const ArrowColumn* col, int64_t rows) {
+    int64_t needed = b->length + rows;
+    if (needed <= b->capacity)
+        return 0;
+    int64_t capacity = b->capacity ? b->capacity : 1024;
+    while (capacity < needed)
+        capacity *= 2;
+
+    // bitmaps are zeroed so only set bits need to be written
+    size_t old_bits = (size_t)(b->capacity + 7) / 8;
+    size_t new_bits = (size_t)(capacity + 7) / 8;
+    uint8_t* validity = realloc(b->validity, new_bits);
+    if (validity == NULL)
+        return -1;
+    memset(validity + old_bits, 0, new_bits - old_bits);
+    b->validity = validity;
+
+    if (col->format[0] == 'b') {
+        uint8_t* data = realloc(b->data, new_bits);
+        if (data == NULL)
+            return -1;
+        memset(data + old_bits, 0, new_bits - old_bits);
+        b->data = data;
+    } else if (col->width) {
+        uint8_t* data = realloc(b->data, (size_t)capacity * col->width);
+        if (data == NULL)
+            return -1;
+        b->data = data;
+    } else {
+        int32_t* offsets = realloc(b->offsets, (size_t)(capacity + 1) * sizeof(int32_t));
+        if (offsets == NULL)
+            return -1;
+        if (b->capacity == 0)
+            offsets[0] = 0;
+        b->offsets = offsets;
+    }
+    b->capacity = capacity;
+    return 0;
+}
+
+static int arrow_builder_reserve_data(ArrowBuilder* b, int64_t bytes) {
+    int64_t needed = b->data_size + bytes;
+    if (needed <= b->data_capacity)
+        return 0;
+    int64_t capacity = b->data_capacity ? b->data_capacity : 16384;
+    while (capacity < needed)
+        capacity *= 2;
+    uint8_t* data = realloc(b->data, (size_t)capacity);
+    if (data == NULL)
+        return -1;
+    b->data = data;
+    b->data_capacity = capacity;
+    return 0;
+}
+
+// appends rows [first_row, first_row + rows) of a column, returns NULL or a malloc'd error message
+static char* arrow_builder_append(ArrowBuilder* b, const ArrowColumn* col, const PGresult* res, int column, int first_row, int rows) {
+    char* error = NULL;
+    if (arrow_builder_reserve(b, col, rows) < 0)
+        return strdup("out of memory");
+
+    int64_t start = b->length;
+    for (int i = 0; i < rows; i++) {
+        if (PQgetisnull(res, first_row + i, column))
+            b->null_count++;
+        else
+            b->validity[(start + i) / 8] |= (uint8_t)(1 << ((start + i) % 8));
+    }
+
+    if (col->format[0] == 'b') {
+        for (int i = 0; i < rows; i++) {
+            int row = first_row + i;
+            if (PQgetisnull(res, row, column))
+                continue;
+            const char* value = PQgetvalue(res, row, column);
+            if (col->binary ? value[0] != 0 : value[0] == 't')
+                b->data[(start + i) / 8] |= (uint8_t)(1 << ((start + i) % 8));
+        }
+    } else if (col->width && col->binary) {
+        // fixed-width binary values are gathered and byte swapped in bulk
+        decode_binary_column(res, column, first_row, rows, col->width, b->data + start * col->width);
+    } else if (col->width) {
+        // fixed-width text values are parsed
+        for (int i = 0; i < rows; i++) {
+            int row = first_row + i;
+            uint8_t* dest = b->data + (start + i) * col->width;
+            if (PQgetisnull(res, row, column)) {
+                memset(dest, 0, col->width);
+                continue;
+            }
+            const char* text = PQgetvalue(res, row, column);
+            int length = PQgetlength(res, row, column);
+            int failed;
+            if (col->format[0] == 'f' || col->format[0] == 'g') {
+                double value;
+                failed = parse_float8(text, length, &value) < 0;
+                if (col->format[0] == 'f') {
+                    float narrow = (float)value;
+                    memcpy(dest, &narrow, sizeof(narrow));
+                } else {
+                    memcpy(dest, &value, sizeof(value));
+                }
+            } else {
+                int64_t value;
+                failed = parse_int64(text, length, &value) < 0;
+                if (col->width == 2) {
+                    int16_t narrow = (int16_t)value;
+                    memcpy(dest, &narrow, sizeof(narrow));
+                } else if (col->width == 4) {
+                    int32_t narrow = (int32_t)value;
+                    memcpy(dest, &narrow, sizeof(narrow));
+                } else {
+                    memcpy(dest, &value, sizeof(value));
+                }
+            }
+            if (failed) {
+                if (asprintf(&error, "cannot convert '%s' in column '%s' to a number", text, col->name) < 0)
+                    error = strdup("malformed number");
+                return error;
+            }
+        }
+    } else {
+        for (int i = 0; i < rows; i++) {
+            int row = first_row + i;
+            int length = PQgetisnull(res, row, column) ? 0 : PQgetlength(res, row, column);
+            if (b->data_size + length > INT32_MAX)
+                return strdup("batch is too large for 32-bit string offsets, use a smaller batch_rows");
+            if (arrow_builder_reserve_data(b, length) < 0)
+                return strdup("out of memory");
+            memcpy(b->data + b->data_size, PQgetvalue(res, row, column), length);
+            b->data_size += length;
+            b->offsets[start + i + 1] = (int32_t)b->data_size;
+        }
+    }
+
+    b->length += rows;
+    return NULL;
+}
+
+// buffers owned by an exported array
+typedef struct {
+    const void* buffers[3];
+    struct ArrowArray** children;
+} ArrowArrayPrivate;
+
+static void arrow_release_array(struct ArrowArray* array) {
+    ArrowArrayPrivate* private = (ArrowArrayPrivate*)array->private_data;
+    for (int64_t i = 0; i < array->n_children; i++) {
+        struct ArrowArray* child = private->children[i];
+        // a consumer may have moved the child out already
+        if (child->release != NULL)
+            child->release(child);
+        free(child);
+    }
+    for (int64_t i = 0; i < array->n_buffers; i++) {
+        free((void*)private->buffers[i]);
+    }
+    free(private->children);
+    free(private);
+    array->release = NULL;
+}
+
+// moves the builder's buffers into an exported array and resets the builder
+static int arrow_builder_finish(ArrowBuilder* b, const ArrowColumn* col, struct ArrowArray* out) {
+    ArrowArrayPrivate* private = calloc(1, sizeof(ArrowArrayPrivate));
+    if (private == NULL)
+        return -1;
+
+    // make sure every buffer exists, even for an empty batch
+    if (b->capacity == 0 && arrow_builder_reserve(b, col, 1) < 0) {
+        free(private);
+        return -1;
+    }
+    if (b->null_count == 0) {
+        free(b->validity);
+        b->validity = NULL;
+    }
+    private->buffers[0] = b->validity;
+    if (col->width || col->format[0] == 'b') {
+        private->buffers[1] = b->data;
+        out->n_buffers = 2;
+    } else {
+        if (b->data == NULL && arrow_builder_reserve_data(b, 1) < 0) {
+            free(private);
+            return -1;
+        }
+        private->buffers[1] = b->offsets;
+        private->buffers[2] = b->data;
+        out->n_buffers = 3;
+    }
+
+    out->length = b->length;
+    out->null_count = b->null_count;
+    out->offset = 0;
+    out->n_children = 0;
+    out->buffers = private->buffers;
+    out->children = NULL;
+    out->dictionary = NULL;
+    out->release = arrow_release_array;
+    out->private_data = private;
+
+    memset(b, 0, sizeof(ArrowBuilder));
+    return 0;
+}
+
+static void arrow_builder_free(ArrowBuilder* b) {
+    free(b->validity);
+    free(b->data);
+    free(b->offsets);
+    memset(b, 0, sizeof(ArrowBuilder));
+}
+
+static void arrow_release_schema(struct ArrowSchema* schema) {
+    for (int64_t i = 0; i < schema->n_children; i++) {
+        struct ArrowSchema* child = schema->children[i];
+        if (child->release != NULL)
+            child->release(child);
+        free(child);
+    }
+    free(schema->children);
+    free((void*)schema->name);
+    schema->release = NULL;
+}
+
+static int arrow_export_schema(const ArrowColumn* cols, int columns, struct ArrowSchema* out) {
+    memset(out, 0, sizeof(struct ArrowSchema));
+    out->format = "+s";
+    out->release = arrow_release_schema;
+    out->children = calloc(columns ? columns : 1, sizeof(struct ArrowSchema*));
+    if (out->children == NULL)
+        return -1;
+    for (int i = 0; i < columns; i++) {
+        struct ArrowSchema* child = calloc(1, sizeof(struct ArrowSchema));
+        if (child == NULL || (child->name = strdup(cols[i].name)) == NULL) {
+            free(child);
+            arrow_release_schema(out);
+            return -1;
+        }
+        child->format = cols[i].format;
+        child->flags = ARROW_FLAG_NULLABLE;
+        child->release = arrow_release_schema;
+        out->children[i] = child;
+        out->n_children++;
+    }
+    return 0;
+}
+
+//
+// stream of record batches from a DataTable or a ForwardCursor
+//
+
+typedef struct {
+    PyObject* source;       // DataTable or ForwardCursor, kept alive by the stream
+    PyInterpreterState* interp; // interpreter that owns source
+    PGresult* res;          // DataTable result, NULL when reading from a ForwardCursor
+    int next_row;           // next DataTable row to export
+    int pending_row;        // the ForwardCursor is positioned on a row that has not been exported yet
+    int consuming;          // the stream has the ForwardCursor to itself until it is freed
+    int batch_rows;
+    int columns;
+    ArrowColumn* cols;
+    ArrowBuilder* builders;
+    char* error;
+} ArrowStreamState;
+
+static void arrow_state_free(ArrowStreamState* state) {
+    for (int i = 0; i < state->columns; i++) {
+        free(state->cols[i].name);
+        arrow_builder_free(&state->builders[i]);
+    }
+    free(state->cols);
+    free(state->builders);
+    free(state->error);
+    if (state->consuming)
+        ForwardCursor_end_consuming(state->source);
+    Py_XDECREF(state->source);
+    PyMem_Free(state);
+}
+
+static ArrowStreamState* arrow_state_new(PyObject* source, const PGresult* schema, int batch_rows) {
+    ArrowStreamState* state = PyMem_Calloc(1, sizeof(ArrowStreamState));
+    if (state == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    state->source = Py_NewRef(source);
+    state->interp = PyInterpreterState_Get();
+    state->batch_rows = batch_rows;
+    int columns = PQnfields(schema);
+    state->cols = calloc(columns ? columns : 1, sizeof(ArrowColumn));
+    state->builders = calloc(columns ? columns : 1, sizeof(ArrowBuilder));
+    if (state->cols == NULL || state->builders == NULL) {
+        arrow_state_free(state);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    state->columns = columns;
+    for (int i = 0; i < columns; i++) {
+        arrow_column_init(&state->cols[i], schema, i);
+    }
+    return state;
+}
+
+static int arrow_stream_fail(ArrowStreamState* state, char* error) {
+    free(state->error);
+    state->error = error != NULL ? error : strdup("out of memory");
+    for (int i = 0; i < state->columns; i++) {
+        arrow_builder_free(&state->builders[i]);
+    }
+    return EIO;
+}
+
+static int arrow_stream_get_schema(struct ArrowArrayStream* stream, struct ArrowSchema* out) {
+    ArrowStreamState* state = (ArrowStreamState*)stream->private_data;
+    if (arrow_export_schema(state->cols, state->columns, out) < 0)
+        return ENOMEM;
+    return 0;
+}
+
+static char* arrow_stream_append(ArrowStreamState* state, const PGresult* res, int first_row, int rows) {
+    for (int i = 0; i < state->columns; i++) {
+        char* error = arrow_builder_append(&state->builders[i], &state->cols[i], res, i, first_row, rows);
+        if (error != NULL)
+            return error;
+    }
+    return NULL;
+}
+
+// reads up to batch_rows rows from the cursor, returns the number of rows or -1 on error
+static int arrow_stream_read_cursor(ArrowStreamState* state) {
+    int rows = 0;
+    while (rows < state->batch_rows) {
+        if (!state->pending_row) {
+            int status = ForwardCursor_advance(state->source);
+            if (status < 0) {
+                arrow_stream_fail(state, strdup(ForwardCursor_error_message(state->source)));
+                return -1;
+            }
+            if (status == 0)
+                break;
+        }
+        state->pending_row = 0;
+        char* error = arrow_stream_append(state, ForwardCursor_result(state->source), 0, 1);
+        if (error != NULL) {
+            arrow_stream_fail(state, error);
+            return -1;
+        }
+        rows++;
+    }
+    return rows;
+}
+
+static int arrow_stream_get_next(struct ArrowArrayStream* stream, struct ArrowArray* out) {
+    ArrowStreamState* state = (ArrowStreamState*)stream->private_data;
+    memset(out, 0, sizeof(struct ArrowArray));
+
+    int rows;
+    if (state->res != NULL) {
+        rows = DataTable_row_count(state->source) - state->next_row;
+        if (rows > state->batch_rows)
+            rows = state->batch_rows;
+        if (rows > 0 && DataTable_is_spilled(state->source)) {
+            // the rows of a spilled table are copied out a batch at a time
+            PGresult* page = DataTable_page(state->source, state->next_row, rows);
+            if (page == NULL)
+                return arrow_stream_fail(state, NULL);
+            char* error = arrow_stream_append(state, page, 0, rows);
+            PQclear(page);
+            if (error != NULL)
+                return arrow_stream_fail(state, error);
+            state->next_row += rows;
+        } else if (rows > 0) {
+            char* error = arrow_stream_append(state, state->res, state->next_row, rows);
+            if (error != NULL)
+                return arrow_stream_fail(state, error);
+            state->next_row += rows;
+        }
+    } else {
+        // reading from the server may block, so let other Python threads run if the consumer has a thread state
+        PyThreadState* thread_state = attached_thread_state() != NULL ? PyEval_SaveThread() : NULL;
+        ConnectionLock* lock = ForwardCursor_lock(state->source);
+        if (ConnectionLock_acquire_detached(lock) < 0) {
+            rows = -1;
+            arrow_stream_fail(state, strdup("the connection is already in use by this thread"));
+        } else {
+            rows = arrow_stream_read_cursor(state);
+            ConnectionLock_release(lock);
+        }
+        if (thread_state != NULL)
+            PyEval_RestoreThread(thread_state);
+        if (rows < 0)
+            return EIO;
+    }
+
+    if (rows <= 0) {
+        // end of stream is signalled by a released array
+        out->release = NULL;
+        return 0;
+    }
+
+    // the batch is a struct array with one child per column
+    ArrowArrayPrivate* private = calloc(1, sizeof(ArrowArrayPrivate));
+    if (private == NULL)
+        return arrow_stream_fail(state, NULL);
+    private->children = calloc(state->columns ? state->columns : 1, sizeof(struct ArrowArray*));
+    if (private->children == NULL) {
+        free(private);
+        return arrow_stream_fail(state, NULL);
+    }
+    out->length = rows;
+    out->n_buffers = 1;
+    out->buffers = private->buffers;
+    out->children = private->children;
+    out->release = arrow_release_array;
+    out->private_data = private;
+    for (int i = 0; i < state->columns; i++) {
+        struct ArrowArray* child = calloc(1, sizeof(struct ArrowArray));
+        if (child == NULL || arrow_builder_finish(&state->builders[i], &state->cols[i], child) < 0) {
+            free(child);
+            arrow_release_array(out);
+            return arrow_stream_fail(state, NULL);
+        }
+        private->children[i] = child;
+        out->n_children++;
+    }
+    return 0;
+}
+
+static const char* arrow_stream_get_last_error(struct ArrowArrayStream* stream) {
+    return ((ArrowStreamState*)stream->private_data)->error;
+}
+
+static void arrow_stream_release(struct ArrowArrayStream* stream) {
+    ArrowStreamState* state = (ArrowStreamState*)stream->private_data;
+
+    // the consumer may release the stream from any thread, but the source must be released
+    // by the interpreter that owns it (PyGILState_Ensure only knows about the main interpreter)
+    PyThreadState* attached = attached_thread_state();
+    if (attached != NULL && PyThreadState_GetInterpreter(attached) == state->interp) {
+        arrow_state_free(state);
+    } else {
+        PyThreadState* saved = attached != NULL ? PyEval_SaveThread() : NULL;
+        PyThreadState* temporary = PyThreadState_New(state->interp);
+        PyEval_RestoreThread(temporary);
+        arrow_state_free(state);
+        PyThreadState_Clear(temporary);
+        PyThreadState_DeleteCurrent();
+        if (saved != NULL)
+            PyEval_RestoreThread(saved);
+    }
+    stream->release = NULL;
+}
+
+static void arrow_stream_capsule_destructor(PyObject* capsule) {
+    struct ArrowArrayStream* stream = PyCapsule_GetPointer(capsule, "arrow_array_stream");
+    if (stream == NULL) {
+        PyErr_WriteUnraisable(capsule);
+        return;
+    }
+    // not imported by a consumer
+    if (stream->release != NULL)
+        stream->release(stream);
+    PyMem_Free(stream);
+}
+
+static void arrow_schema_capsule_destructor(PyObject* capsule) {
+    struct ArrowSchema* schema = PyCapsule_GetPointer(capsule, "arrow_schema");
+    if (schema == NULL) {
+        PyErr_WriteUnraisable(capsule);
+        return;
+    }
+    if (schema->release != NULL)
+        schema->release(schema);
+    PyMem_Free(schema);
+}
+
+// wraps the state in an ArrowArrayStream inside a PyCapsule, the capsule takes ownership of the state
+static PyObject* arrow_state_export(ArrowStreamState* state) {
+    struct ArrowArrayStream* stream = PyMem_Malloc(sizeof(struct ArrowArrayStream));
+    if (stream == NULL) {
+        arrow_state_free(state);
+        return PyErr_NoMemory();
+    }
+    stream->get_schema = arrow_stream_get_schema;
+    stream->get_next = arrow_stream_get_next;
+    stream->get_last_error = arrow_stream_get_last_error;
+    stream->release = arrow_stream_release;
+    stream->private_data = state;
+
+    PyObject* capsule = PyCapsule_New(stream, "arrow_array_stream", arrow_stream_capsule_destructor);
+    if (capsule == NULL) {
+        arrow_state_free(state);
+        PyMem_Free(stream);
+    }
+    return capsule;
+}
+
+//
+// ArrowStream, a single-use Python object implementing the Arrow PyCapsule stream protocol
+//
+
+typedef struct {
+    PyObject_HEAD
+    /* Type-specific fields go here. */
+    ArrowStreamState* state;    // NULL once exported
+} ArrowStreamObject;
+
+static void ArrowStream_dealloc(ArrowStreamObject *self) {
+    if (self->state != NULL) {
+        arrow_state_free(self->state);
+        self->state = NULL;
+    }
+    free_instance((PyObject *)self);
+}
+
+// checks the arguments of __arrow_c_stream__: a requested_schema may be passed, positionally or by keyword, but it is
+// ignored as casting is left to the consumer, which the protocol allows
+int arrow_requested_schema(PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+    static const char* const keywords[] = {"requested_schema", NULL};
+    PyObject* requested_schema;
+    if (find_keyword(args, nargs, kwnames, keywords, "requested_schema", &requested_schema) < 0)
+        return -1;
+    if (nargs > 1 || (nargs == 1 && requested_schema != NULL)) {
+        PyErr_SetString(PyExc_TypeError, "expected at most 1 argument, 'requested_schema'");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject* ArrowStream_arrow_c_stream(ArrowStreamObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    if (arrow_requested_schema(args, nargs, kwnames) < 0)
+        return NULL;
+    if (self->state == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "the Arrow stream has already been consumed");
+        return NULL;
+    }
+    ArrowStreamState* state = self->state;
+    self->state = NULL;
+    return arrow_state_export(state);
+}
+
+static PyObject* ArrowStream_arrow_c_schema(ArrowStreamObject *self, PyObject* ignored) {
+    if (self->state == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "the Arrow stream has already been consumed");
+        return NULL;
+    }
+    struct ArrowSchema* schema = PyMem_Malloc(sizeof(struct ArrowSchema));
+    if (schema == NULL)
+        return PyErr_NoMemory();
+    if (arrow_export_schema(self->state->cols, self->state->columns, schema) < 0) {
+        PyMem_Free(schema);
+        return PyErr_NoMemory();
+    }
+    PyObject* capsule = PyCapsule_New(schema, "arrow_schema", arrow_schema_capsule_destructor);
+    if (capsule == NULL) {
+        schema->release(schema);
+        PyMem_Free(schema);
+    }
+    return capsule;
+}
+
+static PyMethodDef ArrowStream_methods[] = {
+    {"__arrow_c_stream__", (PyCFunction) ArrowStream_arrow_c_stream, METH_FASTCALL|METH_KEYWORDS, "Exports the rows as an ArrowArrayStream PyCapsule, the stream can only be consumed once."},
+    {"__arrow_c_schema__", (PyCFunction) ArrowStream_arrow_c_schema, METH_NOARGS, "Exports the column types as an ArrowSchema PyCapsule."},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot ArrowStream_slots[] = {
+    {Py_tp_doc, PyDoc_STR("Record batches in the Arrow C stream format, e.g. pyarrow.RecordBatchReader.from_stream(stream)")},
+    {Py_tp_dealloc, ArrowStream_dealloc},
+    {Py_tp_methods, ArrowStream_methods},
+    {0, NULL},
+};
+
+PyType_Spec ArrowStream_spec = {
+    .name = "pg.ArrowStream",
+    .basicsize = sizeof(ArrowStreamObject),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = ArrowStream_slots,
+};
+
+// the stream is created by the same module as its source
+static PyObject* ArrowStream_wrap(ArrowStreamState* state) {
+    ArrowStreamObject* obj = PyObject_New(ArrowStreamObject, get_module_state(state->source)->ArrowStreamType);
+    if (obj == NULL) {
+        arrow_state_free(state);
+        return NULL;
+    }
+    obj->state = state;
+    return (PyObject*)obj;
+}
+
+// parses the optional batch_rows argument
+int arrow_batch_rows(PyObject* const* args, Py_ssize_t nargs, int* batch_rows) {
+    *batch_rows = 65536;
+    if (nargs && args[0] != Py_None) {
+        long value = PyLong_AsLong(args[0]);
+        if (value == -1 && PyErr_Occurred())
+            return -1;
+        if (value < 1 || value > INT32_MAX) {
+            PyErr_SetString(PyExc_ValueError, "batch_rows must be a positive int");
+            return -1;
+        }
+        *batch_rows = (int)value;
+    }
+    return 0;
+}
+
+static ArrowStreamState* arrow_state_from_table(PyObject* table, PGresult* res, int batch_rows) {
+    ArrowStreamState* state = arrow_state_new(table, res, batch_rows);
+    if (state != NULL)
+        state->res = res;
+    return state;
+}
+
+// stream of the rows of a DataTable
+PyObject* ArrowStream_from_table(PyObject* table, PGresult* res, int batch_rows) {
+    ArrowStreamState* state = arrow_state_from_table(table, res, batch_rows);
+    return state != NULL ? ArrowStream_wrap(state) : NULL;
+}
+
+// a DataTable's own __arrow_c_stream__
+PyObject* ArrowStream_export_table(PyObject* table, PGresult* res) {
+    ArrowStreamState* state = arrow_state_from_table(table, res, 65536);
+    return state != NULL ? arrow_state_export(state) : NULL;
+}
+
+// stream of the remaining rows of a ForwardCursor, starting with the current row when the cursor is on one
+PyObject* ArrowStream_from_cursor(PyObject* cursor, int batch_rows) {
+    // the stream reads the cursor without the GIL, possibly from the consumer's thread, so keep the getters off it
+    if (ForwardCursor_begin_consuming(cursor) < 0)
+        return NULL;
+    int pending_row = 0;
+    PGresult* res = ForwardCursor_result(cursor);
+    if (res == NULL) {
+        // next_row() has not been called yet, read the first row to find out the columns
+        int status;
+        Py_BEGIN_ALLOW_THREADS
+        status = ForwardCursor_advance(cursor);
+        Py_END_ALLOW_THREADS
+        if (status < 0) {
+            ForwardCursor_set_error(cursor);
+            ForwardCursor_end_consuming(cursor);
+            return NULL;
+        }
+        res = ForwardCursor_result(cursor);
+        pending_row = status;
+    } else {
+        pending_row = PQresultStatus(res) == PGRES_SINGLE_TUPLE;
+    }
+
+    ArrowStreamState* state = arrow_state_new(cursor, res, batch_rows);
+    if (state == NULL) {
+        ForwardCursor_end_consuming(cursor);
+        return NULL;
+    }
+    state->pending_row = pending_row;
+    state->consuming = 1;
+    return ArrowStream_wrap(state);
+}
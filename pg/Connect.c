@@ -0,0 +1,438 @@
+#include "module.h"
+#include <libpq-fe.h>
+#include <errno.h>
+#include <poll.h>
+
+// opening connections without blocking on each handshake in turn: connect_many() drives PQconnectPoll
+// for all of its connections at once with the GIL released, Connection.connect() drives one from an asyncio event loop
+
+// defined in Connection.c
+PyObject* Connection_from_conn(ModuleState* state, PGconn* conn);
+int find_keyword(PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames, const char* const* allowed, const char* name, PyObject** value);
+int timeout_to_seconds(PyObject* timeout, double* seconds);
+int timeout_to_deadline(PyObject* timeout, double* deadline);
+int deadline_to_poll_timeout(double deadline);
+
+// starts connecting, returns NULL with an exception set if libpq cannot even start (e.g. a malformed conninfo)
+static PGconn* connect_start(const char* conninfo) {
+    PGconn* conn = PQconnectStart(conninfo);
+    if (conn == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    if (PQstatus(conn) == CONNECTION_BAD) {
+        PyErr_SetString(PyExc_ConnectionError, PQerrorMessage(conn));
+        PQfinish(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+// advances every connection whose socket is ready until they have all connected, without using the Python API.
+// polling holds the last PQconnectPoll status of each connection, pfds and pending have room for n entries.
+// returns 0 when all are connected, 1 when the deadline passed, 2 when interrupted by a signal,
+// -1 when a connection failed (*failed is its index) or -2 when poll failed (see errno)
+static int connect_poll_all(PGconn** conns, PostgresPollingStatusType* polling, int n, double deadline, struct pollfd* pfds, int* pending, int* failed) {
+    for (;;) {
+        int waiting = 0;
+        for (int i = 0; i < n; i++) {
+            if (polling[i] == PGRES_POLLING_OK)
+                continue;
+            if (polling[i] == PGRES_POLLING_FAILED) {
+                *failed = i;
+                return -1;
+            }
+            pfds[waiting].fd = PQsocket(conns[i]);
+            pfds[waiting].events = polling[i] == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+            pfds[waiting].revents = 0;
+            pending[waiting++] = i;
+        }
+        if (waiting == 0)
+            return 0;
+
+        int timeout_ms = deadline_to_poll_timeout(deadline);
+        if (timeout_ms == 0)
+            return 1;
+        int rc = poll(pfds, waiting, timeout_ms);
+        if (rc < 0)
+            return errno == EINTR ? 2 : -2;
+
+        for (int j = 0; j < waiting; j++) {
+            if (pfds[j].revents != 0)
+                polling[pending[j]] = PQconnectPoll(conns[pending[j]]);
+        }
+    }
+}
+
+// pg.connect_many(conninfo, n, timeout=None), opens n connections concurrently so the total time is about one handshake
+PyObject* pg_connect_many(PyObject* module, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+    static const char* const keywords[] = {"timeout", NULL};
+    PyObject* timeout;
+    double deadline;
+    if (find_keyword(args, nargs, kwnames, keywords, "timeout", &timeout) < 0
+        || timeout_to_deadline(timeout, &deadline) < 0)
+        return NULL;
+    if (nargs != 2 || !PyUnicode_Check(args[0]) || !PyLong_Check(args[1])) {
+        PyErr_SetString(PyExc_ValueError, "expected the connection string and the number of connections");
+        return NULL;
+    }
+    const char* conninfo = PyUnicode_AsUTF8(args[0]);
+    if (conninfo == NULL)
+        return NULL;
+    long n = PyLong_AsLong(args[1]);
+    if (n == -1 && PyErr_Occurred())
+        return NULL;
+    if (n < 0 || n > INT_MAX / 2) {
+        PyErr_SetString(PyExc_ValueError, "the number of connections is out of range");
+        return NULL;
+    }
+
+    PGconn** conns = PyMem_New(PGconn*, n + 1);
+    PostgresPollingStatusType* polling = PyMem_New(PostgresPollingStatusType, n + 1);
+    struct pollfd* pfds = PyMem_New(struct pollfd, n + 1);
+    int* pending = PyMem_New(int, n + 1);
+    PyObject* result = NULL;
+    int started = 0;
+    if (conns == NULL || polling == NULL || pfds == NULL || pending == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    for (; started < n; started++) {
+        conns[started] = connect_start(conninfo);
+        if (conns[started] == NULL)
+            goto done;
+        // libpq's documentation: behave as if PQconnectPoll last returned PGRES_POLLING_WRITING
+        polling[started] = PGRES_POLLING_WRITING;
+    }
+
+    for (;;) {
+        int status;
+        int failed = -1;
+        Py_BEGIN_ALLOW_THREADS
+        status = connect_poll_all(conns, polling, n, deadline, pfds, pending, &failed);
+        Py_END_ALLOW_THREADS
+
+        if (status == 0)
+            break;
+        if (status == 2) {
+            // interrupted, give signal handlers (e.g. KeyboardInterrupt) a chance to run
+            if (PyErr_CheckSignals() < 0)
+                goto done;
+            continue;
+        }
+        if (status == 1)
+            PyErr_SetString(PyExc_TimeoutError, "timed out while connecting");
+        else if (status == -1)
+            PyErr_SetString(PyExc_ConnectionError, PQerrorMessage(conns[failed]));
+        else
+            PyErr_SetFromErrno(PyExc_OSError);
+        goto done;
+    }
+
+    ModuleState* state = (ModuleState*)PyModule_GetState(module);
+    result = PyList_New(n);
+    if (result == NULL)
+        goto done;
+    for (int i = 0; i < n; i++) {
+        // the Connection owns the PGconn from here, even if it could not be created
+        PGconn* conn = conns[i];
+        conns[i] = NULL;
+        PyObject* connection = Connection_from_conn(state, conn);
+        if (connection == NULL) {
+            Py_CLEAR(result);
+            goto done;
+        }
+        PyList_SET_ITEM(result, i, connection);
+    }
+
+done:
+    for (int i = 0; i < started; i++) {
+        if (conns[i] != NULL)
+            PQfinish(conns[i]);
+    }
+    PyMem_Free(conns);
+    PyMem_Free(polling);
+    PyMem_Free(pfds);
+    PyMem_Free(pending);
+    return result;
+}
+
+//
+// ConnectAttempt, drives the connection handshake of Connection.connect() from an asyncio event loop
+//
+
+typedef struct {
+    PyObject_HEAD
+    /* Type-specific fields go here. */
+    PGconn* conn;                       // the connection being opened, NULL once handed over or abandoned
+    PostgresPollingStatusType polling;  // last PQconnectPoll status
+    PyObject* loop;                     // event loop driving the handshake, NULL once finished
+    PyObject* future;                   // completes with the Connection
+    PyObject* on_ready;                 // bound callback passed to loop.add_reader / add_writer
+    PyObject* timer;                    // handle of the timeout callback, or NULL
+    int socket;                         // socket registered with the loop, -1 when none
+    int for_write;                      // whether the socket was registered with add_writer
+} ConnectAttemptObject;
+
+static int ConnectAttempt_traverse(ConnectAttemptObject *self, visitproc visit, void *arg) {
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->loop);
+    Py_VISIT(self->future);
+    Py_VISIT(self->on_ready);
+    Py_VISIT(self->timer);
+    return 0;
+}
+
+static int ConnectAttempt_clear(ConnectAttemptObject *self) {
+    Py_CLEAR(self->loop);
+    Py_CLEAR(self->future);
+    Py_CLEAR(self->on_ready);
+    Py_CLEAR(self->timer);
+    return 0;
+}
+
+static void ConnectAttempt_dealloc(ConnectAttemptObject *self) {
+    PyObject_GC_UnTrack(self);
+    ConnectAttempt_clear(self);
+    if (self->conn != NULL) {
+        PQfinish(self->conn);
+        self->conn = NULL;
+    }
+    free_instance((PyObject *)self);
+}
+
+// stop watching the socket, must happen before PQconnectPoll as libpq may close it and open another with the same number
+static int ConnectAttempt_unwatch(ConnectAttemptObject *self) {
+    if (self->socket < 0)
+        return 0;
+    PyObject* removed = PyObject_CallMethod(self->loop, self->for_write ? "remove_writer" : "remove_reader", "i", self->socket);
+    self->socket = -1;
+    if (removed == NULL)
+        return -1;
+    Py_DECREF(removed);
+    return 0;
+}
+
+// ends the attempt, completing the future with connection or, when it is NULL, with the current exception.
+// a cancelled future is left alone. Returns None, or NULL if the future could not be completed
+static PyObject* ConnectAttempt_finish(ConnectAttemptObject *self, PyObject* connection) {
+    if (self->loop == NULL)
+        Py_RETURN_NONE;
+
+    PyObject *type = NULL, *value = NULL, *traceback = NULL;
+    if (connection == NULL) {
+        PyErr_Fetch(&type, &value, &traceback);
+        PyErr_NormalizeException(&type, &value, &traceback);
+    }
+
+    int ok = ConnectAttempt_unwatch(self) == 0;
+    if (self->timer != NULL) {
+        PyObject* cancelled = PyObject_CallMethod(self->timer, "cancel", NULL);
+        ok = ok && cancelled != NULL;
+        Py_XDECREF(cancelled);
+    }
+    PyObject* done = ok ? PyObject_CallMethod(self->future, "done", NULL) : NULL;
+    int is_done = done != NULL ? PyObject_IsTrue(done) : -1;
+    Py_XDECREF(done);
+
+    PyObject* result = NULL;
+    if (is_done == 0)
+        result = connection != NULL ? PyObject_CallMethod(self->future, "set_result", "O", connection)
+            : PyObject_CallMethod(self->future, "set_exception", "O", value);
+    else if (is_done == 1)
+        result = Py_NewRef(Py_None);
+
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(traceback);
+    if (self->conn != NULL) {
+        PQfinish(self->conn);
+        self->conn = NULL;
+    }
+    // breaks the cycles through the bound callbacks
+    ConnectAttempt_clear(self);
+    return result;
+}
+
+// acts on the last PQconnectPoll status: completes the future or waits for the socket
+static PyObject* ConnectAttempt_step(ConnectAttemptObject *self) {
+    if (self->polling == PGRES_POLLING_OK) {
+        PGconn* conn = self->conn;
+        self->conn = NULL;
+        PyObject* connection = Connection_from_conn(get_module_state((PyObject*)self), conn);
+        if (connection == NULL)
+            return ConnectAttempt_finish(self, NULL);
+        PyObject* result = ConnectAttempt_finish(self, connection);
+        Py_DECREF(connection);
+        return result;
+    }
+    if (self->polling == PGRES_POLLING_FAILED) {
+        PyErr_SetString(PyExc_ConnectionError, PQerrorMessage(self->conn));
+        return ConnectAttempt_finish(self, NULL);
+    }
+
+    int socket = PQsocket(self->conn);
+    int for_write = self->polling == PGRES_POLLING_WRITING;
+    PyObject* added = PyObject_CallMethod(self->loop, for_write ? "add_writer" : "add_reader", "iO", socket, self->on_ready);
+    if (added == NULL)
+        return ConnectAttempt_finish(self, NULL);
+    Py_DECREF(added);
+    self->socket = socket;
+    self->for_write = for_write;
+    Py_RETURN_NONE;
+}
+
+// called by the event loop when the socket is ready
+static PyObject* ConnectAttempt_on_ready(ConnectAttemptObject *self, PyObject* ignored) {
+    if (self->loop == NULL)
+        Py_RETURN_NONE;
+    if (ConnectAttempt_unwatch(self) < 0)
+        return ConnectAttempt_finish(self, NULL);
+
+    PostgresPollingStatusType polling;
+    Py_BEGIN_ALLOW_THREADS
+    polling = PQconnectPoll(self->conn);
+    Py_END_ALLOW_THREADS
+    self->polling = polling;
+    return ConnectAttempt_step(self);
+}
+
+// called by the event loop when the timeout expires
+static PyObject* ConnectAttempt_on_timeout(ConnectAttemptObject *self, PyObject* ignored) {
+    Py_CLEAR(self->timer);
+    PyErr_SetString(PyExc_TimeoutError, "timed out while connecting");
+    return ConnectAttempt_finish(self, NULL);
+}
+
+// called when the future completes, closes the connection if the awaiting task was cancelled
+static PyObject* ConnectAttempt_on_done(ConnectAttemptObject *self, PyObject* future) {
+    return ConnectAttempt_finish(self, Py_None);
+}
+
+static PyMethodDef ConnectAttempt_on_ready_def = {
+    "_on_ready", (PyCFunction) ConnectAttempt_on_ready, METH_NOARGS, NULL
+};
+
+static PyMethodDef ConnectAttempt_on_timeout_def = {
+    "_on_timeout", (PyCFunction) ConnectAttempt_on_timeout, METH_NOARGS, NULL
+};
+
+static PyMethodDef ConnectAttempt_on_done_def = {
+    "_on_done", (PyCFunction) ConnectAttempt_on_done, METH_O, NULL
+};
+
+static PyType_Slot ConnectAttempt_slots[] = {
+    {Py_tp_doc, PyDoc_STR("A connection being opened by Connection.connect()")},
+    {Py_tp_dealloc, ConnectAttempt_dealloc},
+    {Py_tp_traverse, ConnectAttempt_traverse},
+    {Py_tp_clear, ConnectAttempt_clear},
+    {0, NULL},
+};
+
+PyType_Spec ConnectAttempt_spec = {
+    .name = "pg.ConnectAttempt",
+    .basicsize = sizeof(ConnectAttemptObject),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_DISALLOW_INSTANTIATION | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = ConnectAttempt_slots,
+};
+
+// Connection.connect(conninfo, timeout=None), returns a future that completes with the open Connection.
+// the handshake runs on the event loop, a host name is still resolved by libpq while blocking (use hostaddr to avoid it)
+PyObject* Connection_connect_async(PyTypeObject* cls, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+    static const char* const keywords[] = {"timeout", NULL};
+    PyObject* timeout;
+    if (find_keyword(args, nargs, kwnames, keywords, "timeout", &timeout) < 0)
+        return NULL;
+    if (nargs != 1 || !PyUnicode_Check(args[0])) {
+        PyErr_SetString(PyExc_ValueError, "expected a single string argument of the connection string");
+        return NULL;
+    }
+    double seconds;
+    if (timeout_to_seconds(timeout, &seconds) < 0)
+        return NULL;
+    const char* conninfo = PyUnicode_AsUTF8(args[0]);
+    if (conninfo == NULL)
+        return NULL;
+
+    PyObject* asyncio = PyImport_ImportModule("asyncio");
+    if (asyncio == NULL)
+        return NULL;
+    PyObject* loop = PyObject_CallMethod(asyncio, "get_running_loop", NULL);
+    Py_DECREF(asyncio);
+    if (loop == NULL)
+        return NULL;
+
+    ModuleState* state = (ModuleState*)PyType_GetModuleState(cls);
+    ConnectAttemptObject* self = PyObject_GC_New(ConnectAttemptObject, state->ConnectAttemptType);
+    if (self == NULL) {
+        Py_DECREF(loop);
+        return NULL;
+    }
+    self->conn = NULL;
+    self->polling = PGRES_POLLING_WRITING;
+    self->loop = loop;
+    self->future = NULL;
+    self->on_ready = NULL;
+    self->timer = NULL;
+    self->socket = -1;
+    self->for_write = 0;
+    PyObject_GC_Track(self);
+
+    PyObject* future = NULL;
+    PyObject* on_done = NULL;
+    PyObject* on_timeout = NULL;
+    self->future = PyObject_CallMethod(loop, "create_future", NULL);
+    self->on_ready = PyCFunction_New(&ConnectAttempt_on_ready_def, (PyObject*)self);
+    on_done = PyCFunction_New(&ConnectAttempt_on_done_def, (PyObject*)self);
+    if (self->future == NULL || self->on_ready == NULL || on_done == NULL)
+        goto done;
+    future = Py_NewRef(self->future);
+
+    self->conn = connect_start(conninfo);
+    if (self->conn == NULL)
+        goto done;
+    if (seconds >= 0) {
+        on_timeout = PyCFunction_New(&ConnectAttempt_on_timeout_def, (PyObject*)self);
+        if (on_timeout == NULL)
+            goto done;
+        self->timer = PyObject_CallMethod(loop, "call_later", "dO", seconds, on_timeout);
+        if (self->timer == NULL)
+            goto done;
+    }
+    PyObject* added = PyObject_CallMethod(future, "add_done_callback", "O", on_done);
+    if (added == NULL)
+        goto done;
+    Py_DECREF(added);
+
+    // libpq's documentation: behave as if PQconnectPoll last returned PGRES_POLLING_WRITING
+    PyObject* stepped = ConnectAttempt_step(self);
+    if (stepped == NULL)
+        goto done;
+    Py_DECREF(stepped);
+
+    Py_XDECREF(on_done);
+    Py_XDECREF(on_timeout);
+    Py_DECREF(self);
+    return future;
+
+done:
+    if (self->loop != NULL) {
+        // not started yet, nothing to complete
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        if (self->timer != NULL) {
+            PyObject* cancelled = PyObject_CallMethod(self->timer, "cancel", NULL);
+            Py_XDECREF(cancelled);
+            PyErr_Clear();
+        }
+        ConnectAttempt_clear(self);
+        PyErr_Restore(type, value, traceback);
+    }
+    Py_XDECREF(future);
+    Py_XDECREF(on_done);
+    Py_XDECREF(on_timeout);
+    Py_DECREF(self);
+    return NULL;
+}
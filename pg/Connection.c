@@ -1,17 +1,67 @@
-#define PY_SSIZE_T_CLEAN
-#include <Python.h>
+#include "module.h"
 #include <libpq-fe.h>
-
-PyObject* DataTable_new(PGresult* res);
-PyObject* ForwardCursor_new(PGconn* conn);
+#include "decode.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+PyObject* DataTable_new(ModuleState* state, PGresult* res);
+
+// defined in Spill.c
+typedef struct SpillStore SpillStore;
+SpillStore* SpillStore_new(int columns, size_t threshold);
+void SpillStore_free(SpillStore* store);
+int SpillStore_append_row(SpillStore* store, const PGresult* res, int row);
+int SpillStore_finish(SpillStore* store);
+PyObject* DataTable_new_spilled(ModuleState* state, PGresult* res, SpillStore* spill);
+PyObject* ForwardCursor_new(ModuleState* state, PyObject* connection, double deadline);
+PyObject* Notifications_drain(PGconn* conn);
+PyObject* NotificationStream_new(ModuleState* state, PyObject* connection);
+
+// defined in Connect.c
+PyObject* Connection_connect_async(PyTypeObject* cls, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames);
+PyObject* pg_connect_many(PyObject* module, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames);
+
+// defined in QueryCache.c
+typedef struct QueryCache QueryCache;
+QueryCache* QueryCache_new(Py_ssize_t max_entries, double ttl, PyObject* channel);
+void QueryCache_free(QueryCache* cache);
+PyObject* QueryCache_channel(QueryCache* cache);
+PyObject* QueryCache_key(PyObject* sql, PyObject** str_args, Py_ssize_t nparams);
+PyObject* QueryCache_get(QueryCache* cache, PyObject* key);
+int QueryCache_put(QueryCache* cache, PyObject* key, PyObject* table);
+void QueryCache_clear(QueryCache* cache);
+int QueryCache_invalidate(QueryCache* cache, PyObject* payload);
 
 typedef struct {
     PyObject_HEAD
     /* Type-specific fields go here. */
     PGconn* conn;
+    QueryCache* cache;                  // NULL unless enable_cache() has been called
+    PyObject* pending_notifications;    // notifications read while checking for cache invalidations, or NULL
+    double query_deadline;              // deadline of the last start_query, negative for none
+    ConnectionLock lock;                // held while conn, cache or pending_notifications are in use
 } ConnectionObject;
 
 
+static PyObject* Connection_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    ConnectionObject* self = (ConnectionObject*)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    self->query_deadline = -1;
+    if (ConnectionLock_init(&self->lock) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject*)self;
+}
+
 static void Connection_dealloc(ConnectionObject *self)
 {
     // close the connection, if it is open
@@ -19,7 +69,13 @@ static void Connection_dealloc(ConnectionObject *self)
         PQfinish(self->conn);
         self->conn = NULL;
     }
-    Py_TYPE(self)->tp_free((PyObject *)self);
+    if (self->cache != NULL) {
+        QueryCache_free(self->cache);
+        self->cache = NULL;
+    }
+    Py_CLEAR(self->pending_notifications);
+    ConnectionLock_free(&self->lock);
+    free_instance((PyObject *)self);
 }
 
 // __init__ method
@@ -31,24 +87,334 @@ static int Connection_init(ConnectionObject *self, PyObject *args)
     if (!PyArg_ParseTuple(args, "s", &connection_string))
         return -1;
 
+    if (ConnectionLock_acquire(&self->lock) < 0)
+        return -1;
+    if (self->conn != NULL)
+        PQfinish(self->conn);
+    self->query_deadline = -1;
+
+    // connecting may take a while, let other threads run
+    Py_BEGIN_ALLOW_THREADS
     self->conn = PQconnectdb(connection_string);
+    Py_END_ALLOW_THREADS
 
     // check we connected, raise ConnectionError if we failed 
     ConnStatusType status = PQstatus(self->conn);
     if (status != CONNECTION_OK) {
         error_message = PQerrorMessage(self->conn);
         PyErr_SetString(PyExc_ConnectionError, error_message);
+        ConnectionLock_release(&self->lock);
         return -1;
     }
 
+    ConnectionLock_release(&self->lock);
     return 0;
 }
 
+// wraps a connection opened without __init__, e.g. by connect_many(). Takes ownership of conn, even on failure
+PyObject* Connection_from_conn(ModuleState* state, PGconn* conn) {
+    ConnectionObject* self = (ConnectionObject*)Connection_new(state->ConnectionType, NULL, NULL);
+    if (self == NULL) {
+        PQfinish(conn);
+        return NULL;
+    }
+    self->conn = conn;
+    return (PyObject*)self;
+}
+
+// allow other types to reach the underlying connection, NULL once the connection is closed
+PGconn* Connection_get_conn(PyObject* connection) {
+    return ((ConnectionObject*)connection)->conn;
+}
+
+// the lock other types must hold while using the connection
+ConnectionLock* Connection_lock(PyObject* connection) {
+    return &((ConnectionObject*)connection)->lock;
+}
+
+// reads the notifications libpq has received, applying those on the cache channel
+// and queuing the rest for notifications()
+static int Connection_route_notifications(ConnectionObject *self) {
+    PyObject* batch = Notifications_drain(self->conn);
+    if (batch == NULL)
+        return -1;
+
+    PyObject* cache_channel = self->cache != NULL ? QueryCache_channel(self->cache) : NULL;
+    int result = 0;
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(batch) && result == 0; i++) {
+        PyObject* item = PyList_GET_ITEM(batch, i);
+        if (cache_channel != NULL && PyUnicode_Compare(PyTuple_GET_ITEM(item, 0), cache_channel) == 0) {
+            result = QueryCache_invalidate(self->cache, PyTuple_GET_ITEM(item, 2));
+            continue;
+        }
+        if (self->pending_notifications == NULL) {
+            self->pending_notifications = PyList_New(0);
+            if (self->pending_notifications == NULL) {
+                result = -1;
+                break;
+            }
+        }
+        result = PyList_Append(self->pending_notifications, item);
+    }
+    Py_DECREF(batch);
+    return result;
+}
+
+// returns (and forgets) the notifications received so far, the caller must hold the lock and have called PQconsumeInput
+PyObject* Connection_take_notifications(PyObject* connection) {
+    ConnectionObject* self = (ConnectionObject*)connection;
+    if (Connection_route_notifications(self) < 0)
+        return NULL;
+    PyObject* batch = self->pending_notifications;
+    self->pending_notifications = NULL;
+    return batch != NULL ? batch : PyList_New(0);
+}
+
+// seconds on the monotonic clock, used for deadlines
+double monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// milliseconds left until the deadline for poll(), -1 to wait forever for a negative deadline and 0 once it has passed.
+// clamped to INT_MAX (about 24 days) so a long timeout does not overflow. Does not use the Python API
+int deadline_to_poll_timeout(double deadline) {
+    if (deadline < 0)
+        return -1;
+    double remaining = deadline - monotonic_now();
+    if (remaining <= 0)
+        return 0;
+    double ms = ceil(remaining * 1000);
+    return ms >= INT_MAX ? INT_MAX : (int)ms;
+}
+
+// wait for the connection's socket to become readable (or writable), releasing the GIL while waiting.
+// a negative deadline waits forever. Returns 1 when ready, 0 when the deadline passed, -1 with an exception set on error
+int wait_for_socket(PGconn* conn, int for_write, double deadline) {
+    struct pollfd pfd = { .fd = PQsocket(conn), .events = for_write ? POLLOUT : POLLIN };
+    if (pfd.fd < 0) {
+        PyErr_SetString(PyExc_ConnectionError, "connection is closed");
+        return -1;
+    }
+
+    for (;;) {
+        int timeout_ms = deadline_to_poll_timeout(deadline);
+        int rc;
+        Py_BEGIN_ALLOW_THREADS
+        rc = poll(&pfd, 1, timeout_ms);
+        Py_END_ALLOW_THREADS
+
+        if (rc >= 0)
+            return rc;
+        if (errno != EINTR) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+        // interrupted, give signal handlers (e.g. KeyboardInterrupt) a chance to run
+        if (PyErr_CheckSignals() < 0)
+            return -1;
+    }
+}
+
 // cleanup is passed as a double pointer, so dereference it to clear the result
 void free_result(PGresult** res) {
     PQclear(*res);
 }
 
+// waits until PQgetResult will not block, without using the Python API (so it is safe without the GIL).
+// a negative deadline waits forever. Returns 0 when ready, 1 when the deadline passed, -1 on a connection error
+int pq_wait_result(PGconn* conn, double deadline) {
+    for (;;) {
+        // only read when needed, each read moves the unparsed input to the front of libpq's buffer,
+        // which is quadratic when a single-row-mode caller reads before every row of a large result
+        if (!PQisBusy(conn))
+            return 0;
+        if (PQconsumeInput(conn) == 0)
+            return -1;
+        if (!PQisBusy(conn))
+            return 0;
+
+        int timeout_ms = deadline_to_poll_timeout(deadline);
+        if (timeout_ms == 0)
+            return 1;
+        struct pollfd pfd = { .fd = PQsocket(conn), .events = POLLIN };
+        if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR)
+            return -1;
+    }
+}
+
+// asks the server to cancel the running command, then reads (and discards) results until the connection is idle.
+// does not use the Python API
+void pq_cancel_and_drain(PGconn* conn) {
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+    PGcancelConn* cancel = PQcancelCreate(conn);
+    if (cancel != NULL) {
+        PQcancelBlocking(cancel);
+        PQcancelFinish(cancel);
+    }
+#else
+    PGcancel* cancel = PQgetCancel(conn);
+    if (cancel != NULL) {
+        char errbuf[256];
+        PQcancel(cancel, errbuf, sizeof(errbuf));
+        PQfreeCancel(cancel);
+    }
+#endif
+
+    PGresult* res;
+    while ((res = PQgetResult(conn)) != NULL) {
+        ExecStatusType status = PQresultStatus(res);
+        PQclear(res);
+        if (status == PGRES_COPY_IN) {
+            // PQgetResult keeps returning COPY_IN until the copy is ended
+            PQputCopyEnd(conn, "cancelled by client timeout");
+        } else if (status == PGRES_COPY_OUT) {
+            char* buffer;
+            while (PQgetCopyData(conn, &buffer, 0) > 0) {
+                PQfreemem(buffer);
+            }
+        } else if (PQstatus(conn) == CONNECTION_BAD) {
+            break;
+        }
+    }
+}
+
+// waits, with the GIL released, until the result of the command sent to the server is ready.
+// if the deadline passes the command is cancelled, the connection drained back to idle and TimeoutError raised.
+// returns 0 when PQgetResult will not block, -1 with an exception set
+static int Connection_wait_result(ConnectionObject *self, double deadline) {
+    for (;;) {
+        // see pq_wait_result, don't read while a result is already waiting
+        if (!PQisBusy(self->conn))
+            return 0;
+        if (PQconsumeInput(self->conn) == 0) {
+            PyErr_SetString(PyExc_ConnectionError, PQerrorMessage(self->conn));
+            return -1;
+        }
+        if (!PQisBusy(self->conn))
+            return 0;
+
+        int ready = wait_for_socket(self->conn, 0, deadline);
+        if (ready > 0)
+            continue;
+        if (ready == 0)
+            PyErr_SetString(PyExc_TimeoutError, "the statement was cancelled because the timeout expired");
+
+        // timed out or interrupted (e.g. KeyboardInterrupt), don't leave the statement running
+        Py_BEGIN_ALLOW_THREADS
+        pq_cancel_and_drain(self->conn);
+        Py_END_ALLOW_THREADS
+        return -1;
+    }
+}
+
+// waits for all the results of the command sent to the server and returns the last one (or the first error),
+// or NULL with an exception set.  A COPY result is returned as soon as it arrives
+static PGresult* Connection_get_result(ConnectionObject *self, double deadline) {
+    PGresult* result = NULL;
+    for (;;) {
+        if (Connection_wait_result(self, deadline) < 0) {
+            PQclear(result);
+            return NULL;
+        }
+        PGresult* res = PQgetResult(self->conn);
+        if (res == NULL)
+            break;
+
+        ExecStatusType status = PQresultStatus(res);
+        if (status == PGRES_COPY_IN || status == PGRES_COPY_OUT || status == PGRES_COPY_BOTH) {
+            PQclear(result);
+            return res;
+        }
+        ExecStatusType previous = PQresultStatus(result);
+        if (result != NULL && (previous == PGRES_FATAL_ERROR || previous == PGRES_BAD_RESPONSE)) {
+            // keep the first error
+            PQclear(res);
+        } else {
+            PQclear(result);
+            result = res;
+        }
+    }
+    if (result == NULL)
+        PyErr_SetString(PyExc_ConnectionError, PQerrorMessage(self->conn));
+    return result;
+}
+
+// finds a keyword argument of a METH_FASTCALL|METH_KEYWORDS call, returns a borrowed reference or NULL if not passed.
+// any keyword not in allowed raises TypeError (returning -1). Also used by ForwardCursor.c
+int find_keyword(PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames, const char* const* allowed, const char* name, PyObject** value) {
+    *value = NULL;
+    Py_ssize_t nkwargs = (kwnames == NULL) ? 0 : PyTuple_GET_SIZE(kwnames);
+    for (Py_ssize_t i = 0; i < nkwargs; i++) {
+        PyObject* kwname = PyTuple_GET_ITEM(kwnames, i);
+        int known = 0;
+        for (const char* const* a = allowed; *a != NULL; a++) {
+            if (_PyUnicode_EqualToASCIIString(kwname, *a))
+                known = 1;
+        }
+        if (!known) {
+            PyErr_Format(PyExc_TypeError, "unexpected keyword argument '%U'", kwname);
+            return -1;
+        }
+        if (_PyUnicode_EqualToASCIIString(kwname, name))
+            *value = args[nargs + i];
+    }
+    return 0;
+}
+
+// reads an optional timeout in seconds, None (or no argument) gives -1 for no timeout
+int timeout_to_seconds(PyObject* timeout, double* seconds) {
+    *seconds = -1;
+    if (timeout == NULL || timeout == Py_None)
+        return 0;
+    double value = PyFloat_AsDouble(timeout);
+    if (value == -1 && PyErr_Occurred())
+        return -1;
+    if (!isfinite(value) || value < 0) {
+        PyErr_SetString(PyExc_ValueError, "timeout must be a finite, non-negative number");
+        return -1;
+    }
+    *seconds = value;
+    return 0;
+}
+
+// converts an optional timeout in seconds (None meaning no timeout) into a deadline, negative meaning no deadline
+int timeout_to_deadline(PyObject* timeout, double* deadline) {
+    double seconds;
+    if (timeout_to_seconds(timeout, &seconds) < 0)
+        return -1;
+    *deadline = seconds < 0 ? -1 : monotonic_now() + seconds;
+    return 0;
+}
+
+static const char* const timeout_keywords[] = {"timeout", NULL};
+
+// reads the optional timeout= keyword argument as a deadline
+static int parse_timeout(PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames, double* deadline) {
+    PyObject* timeout;
+    if (find_keyword(args, nargs, kwnames, timeout_keywords, "timeout", &timeout) < 0)
+        return -1;
+    return timeout_to_deadline(timeout, deadline);
+}
+
+// converts the parameters that follow the SQL to strings, returns -1 with an exception set
+// (and the strings converted so far released) if one cannot be converted
+static int convert_params(PyObject* const* args, Py_ssize_t nargs, PyObject** str_args, const char** utf8_args) {
+    for (Py_ssize_t i = 0; i < nargs-1; i++)
+    {
+        str_args[i] = PyObject_Str(args[i+1]);
+        utf8_args[i] = str_args[i] != NULL ? PyUnicode_AsUTF8(str_args[i]) : NULL; // get UTF8 version - no need to free this as it is freed when the str python object is freed
+        if (utf8_args[i] == NULL) {
+            for (Py_ssize_t j = 0; j <= i; j++) {
+                Py_XDECREF(str_args[j]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static PyObject* Connection_execute_script(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs) {
     char* error_message = NULL;
         
@@ -58,8 +424,20 @@ static PyObject* Connection_execute_script(ConnectionObject *self, PyObject* con
     }
     const char* sql_script = PyUnicode_AsUTF8(args[0]);
 
+    int send_status;
+    Py_BEGIN_ALLOW_THREADS
+    send_status = PQsendQuery(self->conn, sql_script);
+    Py_END_ALLOW_THREADS
+    if (send_status == 0) {
+        error_message = PQerrorMessage(self->conn);
+        PyErr_SetString(PyExc_ConnectionError, error_message);
+        return NULL;
+    }
+
     // make sure result is cleared (GCC-specific)
-    PGresult* res __attribute__((cleanup(free_result))) = PQexec(self->conn, sql_script);
+    PGresult* res __attribute__((cleanup(free_result))) = Connection_get_result(self, -1);
+    if (res == NULL)
+        return NULL;
 
     ExecStatusType status = PQresultStatus(res);
     switch (status) {
@@ -68,14 +446,14 @@ static PyObject* Connection_execute_script(ConnectionObject *self, PyObject* con
         case PGRES_TUPLES_OK: // just ignore any tuples
             break;
         default:
-            error_message = PQerrorMessage(self->conn);
+            error_message = PQresultErrorMessage(res);
             PyErr_SetString(PyExc_ConnectionError, error_message);
             return NULL;;
     }
     Py_RETURN_NONE;
 }
 
-static PyObject* Connection_execute(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs) {
+static PyObject* Connection_execute(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
     char* error_message = NULL;
         
     if (!nargs || !PyUnicode_Check(args[0])) {
@@ -84,17 +462,23 @@ static PyObject* Connection_execute(ConnectionObject *self, PyObject* const* arg
     }
     const char* sql_script = PyUnicode_AsUTF8(args[0]);
 
+    double deadline;
+    if (parse_timeout(args, nargs, kwnames, &deadline) < 0)
+        return NULL;
+
     // convert all args to strings
     PyObject** str_args = (PyObject**)malloc(nargs * sizeof(PyObject));
     const char** utf8_args = (const char**)malloc(nargs * sizeof(char*));
-    for (Py_ssize_t i = 0; i < nargs-1; i++)
-    {
-        str_args[i] = PyObject_Str(args[i+1]);
-        utf8_args[i] = PyUnicode_AsUTF8(str_args[i]); // get UTF8 version - no need to free this as it is freed when the str python object is freed
+    if (convert_params(args, nargs, str_args, utf8_args) < 0) {
+        free(str_args);
+        free(utf8_args);
+        return NULL;
     }
     
-    // make sure result is cleared, GCC-specific
-    PGresult* res __attribute__((cleanup(free_result))) = PQexecParams(self->conn, sql_script, nargs-1, NULL, utf8_args, NULL, NULL, 0);
+    int send_status;
+    Py_BEGIN_ALLOW_THREADS
+    send_status = PQsendQueryParams(self->conn, sql_script, nargs-1, NULL, utf8_args, NULL, NULL, 0);
+    Py_END_ALLOW_THREADS
 
     // free args (this also frees the utf8 char* at the same time)
     for (Py_ssize_t i = 0; i < nargs-1; i++) {
@@ -103,6 +487,17 @@ static PyObject* Connection_execute(ConnectionObject *self, PyObject* const* arg
     free(str_args);
     free(utf8_args);
 
+    if (send_status == 0) {
+        error_message = PQerrorMessage(self->conn);
+        PyErr_SetString(PyExc_ConnectionError, error_message);
+        return NULL;
+    }
+
+    // make sure result is cleared, GCC-specific
+    PGresult* res __attribute__((cleanup(free_result))) = Connection_get_result(self, deadline);
+    if (res == NULL)
+        return NULL;
+
     ExecStatusType status = PQresultStatus(res);
     switch (status) {
         case PGRES_COMMAND_OK:
@@ -110,7 +505,7 @@ static PyObject* Connection_execute(ConnectionObject *self, PyObject* const* arg
         case PGRES_TUPLES_OK: // just ignore any tuples
             break;
         default:
-            error_message = PQerrorMessage(self->conn);
+            error_message = PQresultErrorMessage(res);
             PyErr_SetString(PyExc_ConnectionError, error_message);
             return NULL;
     }
@@ -144,14 +539,17 @@ static PyObject* Connection_start_execute(ConnectionObject *self, PyObject* cons
     // convert all args to strings
     PyObject** str_args = (PyObject**)malloc(nargs * sizeof(PyObject));
     const char** utf8_args = (const char**)malloc(nargs * sizeof(char*));
-    for (Py_ssize_t i = 0; i < nargs-1; i++)
-    {
-        str_args[i] = PyObject_Str(args[i+1]);
-        utf8_args[i] = PyUnicode_AsUTF8(str_args[i]); // get UTF8 version - no need to free this as it is freed when the str python object is freed
+    if (convert_params(args, nargs, str_args, utf8_args) < 0) {
+        free(str_args);
+        free(utf8_args);
+        return NULL;
     }
 
     // send the request but do not wait for the result
-    int send_status = PQsendQueryParams(self->conn, sql_script, nargs-1, NULL, utf8_args, NULL, NULL, 0);
+    int send_status;
+    Py_BEGIN_ALLOW_THREADS
+    send_status = PQsendQueryParams(self->conn, sql_script, nargs-1, NULL, utf8_args, NULL, NULL, 0);
+    Py_END_ALLOW_THREADS
 
     // free args (this also frees the utf8 char* at the same time)
     for (Py_ssize_t i = 0; i < nargs-1; i++) {
@@ -174,16 +572,21 @@ static PyObject* Connection_end_execute(ConnectionObject *self, PyObject* const*
     char* error_message = NULL;
 
     // make sure result is cleared, GCC-specific
-    PGresult* res __attribute__((cleanup(free_result))) = PQgetResult(self->conn);
+    PGresult* res __attribute__((cleanup(free_result))) = NULL;
+    Py_BEGIN_ALLOW_THREADS
+    res = PQgetResult(self->conn);
+    Py_END_ALLOW_THREADS
     
     ExecStatusType status = PQresultStatus(res);
     switch (status) {
         case PGRES_COMMAND_OK:
         case PGRES_TUPLES_OK:
         case PGRES_EMPTY_QUERY:        
-            PQconsumeInput(self->conn);
             free_result(&res);
+            Py_BEGIN_ALLOW_THREADS
+            PQconsumeInput(self->conn);
             res = PQgetResult(self->conn);
+            Py_END_ALLOW_THREADS
             Py_RETURN_NONE;
         default:
             error_message = PQerrorMessage(self->conn);
@@ -193,7 +596,130 @@ static PyObject* Connection_end_execute(ConnectionObject *self, PyObject* const*
 }
 
 
-static PyObject* Connection_query(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs) {
+// returns a new reference to a cached DataTable, or NULL (without an exception) on a miss
+static PyObject* Connection_cache_lookup(ConnectionObject *self, PyObject* key) {
+    // apply any invalidations that have arrived since the last query
+    if (QueryCache_channel(self->cache) != NULL) {
+        if (PQconsumeInput(self->conn) == 0) {
+            PyErr_SetString(PyExc_ConnectionError, PQerrorMessage(self->conn));
+            return NULL;
+        }
+        if (Connection_route_notifications(self) < 0)
+            return NULL;
+    }
+    return QueryCache_get(self->cache, key);
+}
+
+// whether a result may be cached: only reads are, going by the command tag, so writes with RETURNING are not
+static int Connection_cacheable(PGresult* res) {
+    static const char* const reads[] = {"SELECT", "VALUES", "SHOW", "TABLE"};
+    const char* tag = PQcmdStatus(res);
+    for (size_t i = 0; i < sizeof(reads) / sizeof(reads[0]); i++) {
+        size_t length = strlen(reads[i]);
+        if (strncmp(tag, reads[i], length) == 0 && (tag[length] == '\0' || tag[length] == ' '))
+            return 1;
+    }
+    return 0;
+}
+
+// moves the rows libpq has already received into the store, without using the Python API so it runs without the GIL.
+// returns 1 when libpq needs more input, otherwise 0 with *res set to the next result that is not a row (NULL at the end)
+static int spill_buffered_rows(PGconn* conn, SpillStore** store, size_t threshold, int* spill_error, PGresult** res) {
+    while (!PQisBusy(conn)) {
+        *res = PQgetResult(conn);
+        if (*res == NULL || PQresultStatus(*res) != PGRES_SINGLE_TUPLE)
+            return 0;
+        if (*store == NULL && *spill_error == 0) {
+            *store = SpillStore_new(PQnfields(*res), threshold);
+            if (*store == NULL)
+                *spill_error = ENOMEM;
+        }
+        if (*spill_error == 0 && SpillStore_append_row(*store, *res, 0) < 0)
+            *spill_error = errno;
+        PQclear(*res);
+        *res = NULL;
+        if (*spill_error != 0) {
+            // stop the query rather than read rows that cannot be kept
+            pq_cancel_and_drain(conn);
+        }
+    }
+    return 1;
+}
+
+// reads the rows of the query just sent one at a time into a SpillStore, which moves them to temporary files
+// once they take more than threshold bytes, so a large result does not have to fit in memory
+static PyObject* Connection_query_spill(ConnectionObject *self, double deadline, size_t threshold) {
+    if (!PQsetSingleRowMode(self->conn)) {
+        PyErr_SetString(PyExc_ConnectionError, PQerrorMessage(self->conn));
+        Py_BEGIN_ALLOW_THREADS
+        pq_cancel_and_drain(self->conn);
+        Py_END_ALLOW_THREADS
+        return NULL;
+    }
+
+    SpillStore* store = NULL;
+    PGresult* result = NULL;    // the final result, or the first error
+    int spill_error = 0;        // errno of a failure to store a row
+    for (;;) {
+        if (Connection_wait_result(self, deadline) < 0) {
+            PQclear(result);
+            SpillStore_free(store);
+            return NULL;
+        }
+        // storing the rows writes to the temporary files once spilled, so let other threads run meanwhile
+        PGresult* res;
+        int busy;
+        Py_BEGIN_ALLOW_THREADS
+        busy = spill_buffered_rows(self->conn, &store, threshold, &spill_error, &res);
+        Py_END_ALLOW_THREADS
+        if (busy)
+            continue;
+        if (res == NULL)
+            break;
+
+        ExecStatusType previous = PQresultStatus(result);
+        if (result != NULL && (previous == PGRES_FATAL_ERROR || previous == PGRES_BAD_RESPONSE)) {
+            // keep the first error
+            PQclear(res);
+        } else {
+            PQclear(result);
+            result = res;
+        }
+    }
+
+    if (spill_error == 0 && store != NULL) {
+        Py_BEGIN_ALLOW_THREADS
+        if (SpillStore_finish(store) < 0)
+            spill_error = errno;
+        Py_END_ALLOW_THREADS
+    }
+    if (spill_error != 0) {
+        errno = spill_error;
+        PyErr_SetFromErrno(PyExc_OSError);
+    } else if (result == NULL) {
+        PyErr_SetString(PyExc_ConnectionError, PQerrorMessage(self->conn));
+    } else {
+        switch (PQresultStatus(result)) {
+            case PGRES_TUPLES_OK:
+                // the final result has no rows but still describes the columns
+                if (store != NULL)
+                    return DataTable_new_spilled(get_module_state((PyObject*)self), result, store);
+                return DataTable_new(get_module_state((PyObject*)self), result);
+            case PGRES_COMMAND_OK:
+            case PGRES_EMPTY_QUERY:
+                SpillStore_free(store);
+                return DataTable_new(get_module_state((PyObject*)self), result);
+            default:
+                PyErr_SetString(PyExc_ConnectionError, PQresultErrorMessage(result));
+                break;
+        }
+    }
+    PQclear(result);
+    SpillStore_free(store);
+    return NULL;
+}
+
+static PyObject* Connection_query(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
     char* error_message = NULL;
         
     if (!nargs || !PyUnicode_Check(args[0])) {
@@ -202,17 +728,54 @@ static PyObject* Connection_query(ConnectionObject *self, PyObject* const* args,
     }
     const char* sql_script = PyUnicode_AsUTF8(args[0]);
 
+    static const char* const keywords[] = {"timeout", "spill_threshold", NULL};
+    PyObject* timeout;
+    PyObject* spill_arg;
+    double deadline;
+    if (find_keyword(args, nargs, kwnames, keywords, "timeout", &timeout) < 0
+        || find_keyword(args, nargs, kwnames, keywords, "spill_threshold", &spill_arg) < 0
+        || timeout_to_deadline(timeout, &deadline) < 0)
+        return NULL;
+    // bytes of rows held in memory before they move to temporary files, negative to buffer the result in libpq as usual
+    Py_ssize_t spill_threshold = -1;
+    if (spill_arg != NULL && spill_arg != Py_None) {
+        spill_threshold = PyLong_Check(spill_arg) ? PyLong_AsSsize_t(spill_arg) : -1;
+        if (spill_threshold < 0) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError, "expected 'spill_threshold' to be a non-negative number of bytes");
+            return NULL;
+        }
+    }
+
     // convert all args to strings
     PyObject** str_args = (PyObject**)malloc(nargs * sizeof(PyObject));
     const char** utf8_args = (const char**)malloc(nargs * sizeof(char*));
-    for (Py_ssize_t i = 0; i < nargs-1; i++)
-    {
-        str_args[i] = PyObject_Str(args[i+1]);
-        utf8_args[i] = PyUnicode_AsUTF8(str_args[i]); // get UTF8 version - no need to free this as it is freed when the str python object is freed
+    if (convert_params(args, nargs, str_args, utf8_args) < 0) {
+        free(str_args);
+        free(utf8_args);
+        return NULL;
+    }
+
+    // repeated reads are served from the cache, when enabled. Results too big to buffer are not cached
+    PyObject* cache_key = NULL;
+    if (self->cache != NULL && spill_threshold < 0) {
+        cache_key = QueryCache_key(args[0], str_args, nargs-1);
+        PyObject* table = cache_key != NULL ? Connection_cache_lookup(self, cache_key) : NULL;
+        if (table != NULL || PyErr_Occurred()) {
+            for (Py_ssize_t i = 0; i < nargs-1; i++) {
+                Py_DECREF(str_args[i]);
+            }
+            free(str_args);
+            free(utf8_args);
+            Py_XDECREF(cache_key);
+            return table;
+        }
     }
     
-    // make sure result is cleared
-    PGresult* res = PQexecParams(self->conn, sql_script, nargs-1, NULL, utf8_args, NULL, NULL, 0);
+    int send_status;
+    Py_BEGIN_ALLOW_THREADS
+    send_status = PQsendQueryParams(self->conn, sql_script, nargs-1, NULL, utf8_args, NULL, NULL, 0);
+    Py_END_ALLOW_THREADS
 
     // free args (this also frees the utf8 char* at the same time)
     for (Py_ssize_t i = 0; i < nargs-1; i++) {
@@ -221,6 +784,23 @@ static PyObject* Connection_query(ConnectionObject *self, PyObject* const* args,
     free(str_args);
     free(utf8_args);
 
+    if (send_status == 0) {
+        error_message = PQerrorMessage(self->conn);
+        PyErr_SetString(PyExc_ConnectionError, error_message);
+        Py_XDECREF(cache_key);
+        return NULL;
+    }
+
+    if (spill_threshold >= 0)
+        return Connection_query_spill(self, deadline, (size_t)spill_threshold);
+
+    // make sure result is cleared
+    PGresult* res = Connection_get_result(self, deadline);
+    if (res == NULL) {
+        Py_XDECREF(cache_key);
+        return NULL;
+    }
+
     ExecStatusType status = PQresultStatus(res);
     switch (status) {
         case PGRES_COMMAND_OK:
@@ -228,12 +808,22 @@ static PyObject* Connection_query(ConnectionObject *self, PyObject* const* args,
         case PGRES_TUPLES_OK: // just ignore any tuples
             break;
         default:
-            error_message = PQerrorMessage(self->conn);
+            error_message = PQresultErrorMessage(res);
             PyErr_SetString(PyExc_ConnectionError, error_message);
             PQclear(res);
+            Py_XDECREF(cache_key);
             return NULL;
     }
-    return DataTable_new(res);
+
+    // only cache reads, not statements that happen to be run via query()
+    int cacheable = status == PGRES_TUPLES_OK && Connection_cacheable(res);
+    PyObject* table = DataTable_new(get_module_state((PyObject*)self), res);
+    if (cache_key != NULL) {
+        if (table != NULL && cacheable && QueryCache_put(self->cache, cache_key, table) < 0)
+            Py_CLEAR(table);
+        Py_DECREF(cache_key);
+    }
+    return table;
 }
 
 static PyObject* Connection_start_query(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
@@ -249,26 +839,34 @@ static PyObject* Connection_start_query(ConnectionObject *self, PyObject* const*
     const int text = 0;
     const int binary = 1;
     int result_format = text;
-    Py_ssize_t nkwargs = (kwnames == NULL) ? 0 : PyTuple_GET_SIZE(kwnames);
-    if (nkwargs > 0) {
-        PyObject* kwname = PyTuple_GET_ITEM(kwnames, 0);
-        PyObject* binary_format = args[nargs];        
-        if (_PyUnicode_EqualToASCIIString(kwname, "binary_format") && PyBool_Check(binary_format) && binary_format == Py_True) {
-            result_format = binary;
-        }
+    static const char* const keywords[] = {"binary_format", "timeout", NULL};
+    PyObject* binary_format;
+    if (find_keyword(args, nargs, kwnames, keywords, "binary_format", &binary_format) < 0)
+        return NULL;
+    if (binary_format != NULL && PyBool_Check(binary_format) && binary_format == Py_True) {
+        result_format = binary;
     }
 
+    // the timeout covers the whole query, up to reading the last row from the cursor
+    PyObject* timeout;
+    double deadline;
+    if (find_keyword(args, nargs, kwnames, keywords, "timeout", &timeout) < 0 || timeout_to_deadline(timeout, &deadline) < 0)
+        return NULL;
+
     // convert all args to strings
     PyObject** str_args = (PyObject**)malloc(nargs * sizeof(PyObject));
     const char** utf8_args = (const char**)malloc(nargs * sizeof(char*));
-    for (Py_ssize_t i = 0; i < nargs-1; i++)
-    {
-        str_args[i] = PyObject_Str(args[i+1]);
-        utf8_args[i] = PyUnicode_AsUTF8(str_args[i]); // get UTF8 version - no need to free this as it is freed when the str python object is freed
+    if (convert_params(args, nargs, str_args, utf8_args) < 0) {
+        free(str_args);
+        free(utf8_args);
+        return NULL;
     }
 
     // send the request but do not wait for the result
-    int send_status = PQsendQueryParams(self->conn, sql_script, nargs-1, NULL, utf8_args, NULL, NULL, result_format);
+    int send_status;
+    Py_BEGIN_ALLOW_THREADS
+    send_status = PQsendQueryParams(self->conn, sql_script, nargs-1, NULL, utf8_args, NULL, NULL, result_format);
+    Py_END_ALLOW_THREADS
 
     // free args (this also frees the utf8 char* at the same time)
     for (Py_ssize_t i = 0; i < nargs-1; i++) {
@@ -285,15 +883,16 @@ static PyObject* Connection_start_query(ConnectionObject *self, PyObject* const*
 
     // request that results are sent back one row at a time (rather than them all being buffered into client memory)
     PQsetSingleRowMode(self->conn);
+    self->query_deadline = deadline;
 
     Py_RETURN_NONE;
 }
 
 static PyObject* Connection_end_query(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs) {
-    return ForwardCursor_new(self->conn);
+    return ForwardCursor_new(get_module_state((PyObject*)self), (PyObject*)self, self->query_deadline);
 }
 
-static PyObject* Connection_start_copy(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs) {
+static PyObject* Connection_start_copy(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
     char* error_message = NULL;
         
     if (!nargs || !PyUnicode_Check(args[0])) {
@@ -302,15 +901,31 @@ static PyObject* Connection_start_copy(ConnectionObject *self, PyObject* const*
     }
     const char* sql_script = PyUnicode_AsUTF8(args[0]);
 
+    double deadline;
+    if (parse_timeout(args, nargs, kwnames, &deadline) < 0)
+        return NULL;
+
+    int send_status;
+    Py_BEGIN_ALLOW_THREADS
+    send_status = PQsendQuery(self->conn, sql_script);
+    Py_END_ALLOW_THREADS
+    if (send_status == 0) {
+        error_message = PQerrorMessage(self->conn);
+        PyErr_SetString(PyExc_ConnectionError, error_message);
+        return NULL;
+    }
+
     // make sure result is cleared (GCC-specific)
-    PGresult* res __attribute__((cleanup(free_result))) = PQexec(self->conn, sql_script);
+    PGresult* res __attribute__((cleanup(free_result))) = Connection_get_result(self, deadline);
+    if (res == NULL)
+        return NULL;
 
     ExecStatusType status = PQresultStatus(res);
     switch (status) {
         case PGRES_COPY_IN:
             break;
         default:
-            error_message = PQerrorMessage(self->conn);
+            error_message = PQresultErrorMessage(res);
             PyErr_SetString(PyExc_ConnectionError, error_message);
             return NULL;
     }
@@ -327,7 +942,13 @@ static PyObject* Connection_put_copy_data(ConnectionObject *self, PyObject* cons
     Py_ssize_t size;
     const char* buffer = PyUnicode_AsUTF8AndSize(args[0], &size);
 
-    int status = PQputCopyData(self->conn, buffer, size);
+    if (buffer == NULL)
+        return NULL;
+
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = PQputCopyData(self->conn, buffer, size);
+    Py_END_ALLOW_THREADS
     switch (status) {
         case 1: // all good
             break;
@@ -342,10 +963,17 @@ static PyObject* Connection_put_copy_data(ConnectionObject *self, PyObject* cons
     Py_RETURN_NONE;
 }
 
-static PyObject* Connection_end_copy(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs) {
+static PyObject* Connection_end_copy(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
     char* error_message = NULL;
 
-    int copy_status = PQputCopyEnd(self->conn, NULL);
+    double deadline;
+    if (parse_timeout(args, nargs, kwnames, &deadline) < 0)
+        return NULL;
+
+    int copy_status;
+    Py_BEGIN_ALLOW_THREADS
+    copy_status = PQputCopyEnd(self->conn, NULL);
+    Py_END_ALLOW_THREADS
     if (copy_status == -1) {
         error_message = PQerrorMessage(self->conn);
         PyErr_SetString(PyExc_ConnectionError, error_message);
@@ -353,104 +981,698 @@ static PyObject* Connection_end_copy(ConnectionObject *self, PyObject* const* ar
     }
 
     // make sure result is cleared (GCC-specific)
-    PGresult* res __attribute__((cleanup(free_result))) = PQgetResult(self->conn);
+    PGresult* res __attribute__((cleanup(free_result))) = Connection_get_result(self, deadline);
+    if (res == NULL)
+        return NULL;
 
     ExecStatusType status = PQresultStatus(res);
     switch (status) {
         case PGRES_COMMAND_OK:
             break;
         default:
+            error_message = PQresultErrorMessage(res);
+            PyErr_SetString(PyExc_ConnectionError, error_message);
+            return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+// growable string used to build SQL
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} SqlBuffer;
+
+static int SqlBuffer_append(SqlBuffer* buffer, const char* text, size_t length) {
+    if (buffer->length + length + 1 > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 256;
+        while (buffer->length + length + 1 > capacity)
+            capacity *= 2;
+        char* data = realloc(buffer->data, capacity);
+        if (data == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->length, text, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = '\0';
+    return 0;
+}
+
+static int is_identifier_char(char c) {
+    return isalnum((unsigned char)c) || c == '_' || (unsigned char)c >= 0x80;
+}
+
+// returns the end of the quoted text, comment or dollar-quoted string starting at p, or p if there is none
+static const char* skip_quoted(const char* sql, const char* p) {
+    const char* end;
+    switch (*p) {
+        case '\'': {
+            // E'...' strings allow backslash escapes
+            int backslash = p > sql && (p[-1] == 'E' || p[-1] == 'e') && (p - 1 == sql || !is_identifier_char(p[-2]));
+            for (end = p + 1; *end; end++) {
+                if (backslash && *end == '\\' && end[1]) {
+                    end++;
+                } else if (*end == '\'') {
+                    if (end[1] != '\'')
+                        return end + 1;
+                    end++;
+                }
+            }
+            return end;
+        }
+        case '"':
+            for (end = p + 1; *end; end++) {
+                if (*end == '"') {
+                    if (end[1] != '"')
+                        return end + 1;
+                    end++;
+                }
+            }
+            return end;
+        case '-':
+            if (p[1] != '-')
+                return p;
+            end = strchr(p, '\n');
+            return end != NULL ? end : p + strlen(p);
+        case '/': {
+            if (p[1] != '*')
+                return p;
+            // block comments nest
+            int depth = 0;
+            for (end = p; *end; end++) {
+                if (end[0] == '/' && end[1] == '*') {
+                    depth++;
+                    end++;
+                } else if (end[0] == '*' && end[1] == '/') {
+                    end++;
+                    if (--depth == 0)
+                        return end + 1;
+                }
+            }
+            return end;
+        }
+        case '$': {
+            // $$...$$ or $tag$...$tag$, but not $1 or part of an identifier
+            if (p > sql && is_identifier_char(p[-1]))
+                return p;
+            const char* tag_end = p + 1;
+            if (*tag_end != '$' && !(isalpha((unsigned char)*tag_end) || *tag_end == '_'))
+                return p;
+            while (*tag_end != '$' && is_identifier_char(*tag_end))
+                tag_end++;
+            if (*tag_end != '$')
+                return p;
+            size_t tag_length = tag_end - p + 1;
+            for (end = tag_end + 1; *end; end++) {
+                if (*end == '$' && strncmp(end, p, tag_length) == 0)
+                    return end + tag_length;
+            }
+            return end;
+        }
+        default:
+            return p;
+    }
+}
+
+// COPY can't take parameters, so each $1, $2 ... outside quoted text and comments is replaced with the
+// argument as an escaped literal. Returns a malloc'd string, or NULL with an exception set
+static char* Connection_inline_params(ConnectionObject *self, const char* sql, PyObject** str_args, Py_ssize_t nparams) {
+    SqlBuffer buffer = {NULL, 0, 0};
+    const char* p = sql;
+    while (*p) {
+        const char* end = skip_quoted(sql, p);
+        if (end != p) {
+            if (SqlBuffer_append(&buffer, p, end - p) < 0)
+                goto error;
+            p = end;
+            continue;
+        }
+        if (*p == '$' && isdigit((unsigned char)p[1]) && (p == sql || !is_identifier_char(p[-1]))) {
+            long index = 0;
+            for (end = p + 1; isdigit((unsigned char)*end); end++) {
+                if (index < 100000)
+                    index = index * 10 + (*end - '0');
+            }
+            if (index < 1 || index > nparams) {
+                PyErr_Format(PyExc_ValueError, "no argument was given for $%ld", index);
+                goto error;
+            }
+            Py_ssize_t size;
+            const char* text = PyUnicode_AsUTF8AndSize(str_args[index - 1], &size);
+            char* literal = text != NULL ? PQescapeLiteral(self->conn, text, size) : NULL;
+            if (literal == NULL) {
+                if (!PyErr_Occurred())
+                    PyErr_SetString(PyExc_ConnectionError, PQerrorMessage(self->conn));
+                goto error;
+            }
+            int appended = SqlBuffer_append(&buffer, literal, strlen(literal));
+            PQfreemem(literal);
+            if (appended < 0)
+                goto error;
+            p = end;
+            continue;
+        }
+        if (SqlBuffer_append(&buffer, p, 1) < 0)
+            goto error;
+        p++;
+    }
+    if (buffer.data == NULL && SqlBuffer_append(&buffer, "", 0) < 0)
+        goto error;
+
+    // a trailing semicolon would end the statement inside COPY ( ... )
+    while (buffer.length > 0 && (isspace((unsigned char)buffer.data[buffer.length - 1]) || buffer.data[buffer.length - 1] == ';'))
+        buffer.data[--buffer.length] = '\0';
+    return buffer.data;
+
+error:
+    free(buffer.data);
+    return NULL;
+}
+
+// writes the COPY OUT data that has already arrived to fd, without using the Python API.
+// returns 1 when more data is expected, 0 when the copy has finished, -1 on a connection error
+// and -2 when writing fails (see errno)
+static int copy_out_to_fd(PGconn* conn, int fd, long long* bytes) {
+    for (;;) {
+        char* data;
+        int length = PQgetCopyData(conn, &data, 1);
+        if (length == 0)
+            return 1;
+        if (length == -1)
+            return 0;
+        if (length < 0)
+            return -1;
+
+        int written = 0;
+        while (written < length) {
+            ssize_t n = write(fd, data + written, length - written);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0) {
+                PQfreemem(data);
+                return -2;
+            }
+            written += n;
+        }
+        PQfreemem(data);
+        *bytes += length;
+    }
+}
+
+static PyObject* Connection_query_to_file(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    char* error_message = NULL;
+
+    if (!nargs || !PyUnicode_Check(args[0])) {
+        PyErr_SetString(PyExc_ValueError, "expected the first argument 'sql_script' to be a string");
+        return NULL;
+    }
+    const char* sql_script = PyUnicode_AsUTF8(args[0]);
+
+    static const char* const keywords[] = {"path", "format", "timeout", NULL};
+    PyObject* path_arg;
+    PyObject* format_arg;
+    PyObject* timeout;
+    double deadline;
+    if (find_keyword(args, nargs, kwnames, keywords, "path", &path_arg) < 0
+        || find_keyword(args, nargs, kwnames, keywords, "format", &format_arg) < 0
+        || find_keyword(args, nargs, kwnames, keywords, "timeout", &timeout) < 0
+        || timeout_to_deadline(timeout, &deadline) < 0)
+        return NULL;
+    if (path_arg == NULL) {
+        PyErr_SetString(PyExc_TypeError, "missing the keyword argument 'path'");
+        return NULL;
+    }
+    const char* format = "csv";
+    if (format_arg != NULL) {
+        format = PyUnicode_Check(format_arg) ? PyUnicode_AsUTF8(format_arg) : NULL;
+        if (format == NULL || (strcmp(format, "csv") != 0 && strcmp(format, "binary") != 0 && strcmp(format, "text") != 0)) {
+            PyErr_SetString(PyExc_ValueError, "expected 'format' to be 'csv', 'binary' or 'text'");
+            return NULL;
+        }
+    }
+
+    // convert all args to strings and put them in the SQL
+    PyObject** str_args = (PyObject**)malloc(nargs * sizeof(PyObject));
+    const char** utf8_args = (const char**)malloc(nargs * sizeof(char*));
+    if (convert_params(args, nargs, str_args, utf8_args) < 0) {
+        free(str_args);
+        free(utf8_args);
+        return NULL;
+    }
+    char* query = Connection_inline_params(self, sql_script, str_args, nargs-1);
+    for (Py_ssize_t i = 0; i < nargs-1; i++) {
+        Py_DECREF(str_args[i]);
+    }
+    free(str_args);
+    free(utf8_args);
+    if (query == NULL)
+        return NULL;
+    // the newline ends any -- comment at the end of the query
+    PyObject* copy = PyUnicode_FromFormat("COPY (%s\n) TO STDOUT (FORMAT %s)", query, format);
+    free(query);
+    if (copy == NULL)
+        return NULL;
+
+    PyObject* path;
+    if (!PyUnicode_FSConverter(path_arg, &path)) {
+        Py_DECREF(copy);
+        return NULL;
+    }
+
+    const char* copy_sql = PyUnicode_AsUTF8(copy);
+    int send_status = 0;
+    if (copy_sql != NULL) {
+        Py_BEGIN_ALLOW_THREADS
+        send_status = PQsendQuery(self->conn, copy_sql);
+        Py_END_ALLOW_THREADS
+    }
+    Py_DECREF(copy);
+    if (send_status == 0) {
+        error_message = PQerrorMessage(self->conn);
+        PyErr_SetString(PyExc_ConnectionError, error_message);
+        Py_DECREF(path);
+        return NULL;
+    }
+
+    PGresult* res = Connection_get_result(self, deadline);
+    if (res == NULL) {
+        Py_DECREF(path);
+        return NULL;
+    }
+    if (PQresultStatus(res) != PGRES_COPY_OUT) {
+        error_message = PQresultErrorMessage(res);
+        PyErr_SetString(PyExc_ConnectionError, error_message);
+        PQclear(res);
+        Py_DECREF(path);
+        return NULL;
+    }
+    PQclear(res);
+
+    // only touch the file once the server has accepted the COPY, so a failing query leaves an existing file alone
+    int fd;
+    Py_BEGIN_ALLOW_THREADS
+    fd = open(PyBytes_AS_STRING(path), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    Py_END_ALLOW_THREADS
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path_arg);
+        Py_BEGIN_ALLOW_THREADS
+        pq_cancel_and_drain(self->conn);
+        Py_END_ALLOW_THREADS
+        Py_DECREF(path);
+        return NULL;
+    }
+
+    // the rows go straight from libpq's buffer to the file, Python only runs between network waits
+    long long bytes = 0;
+    for (;;) {
+        int status;
+        int write_errno;
+        Py_BEGIN_ALLOW_THREADS
+        status = copy_out_to_fd(self->conn, fd, &bytes);
+        write_errno = errno;
+        Py_END_ALLOW_THREADS
+        if (status == 0)
+            break;
+
+        int ready = 0;
+        if (status == -1) {
+            PyErr_SetString(PyExc_ConnectionError, PQerrorMessage(self->conn));
+        } else if (status == -2) {
+            errno = write_errno;
+            PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path_arg);
+        } else {
+            ready = wait_for_socket(self->conn, 0, deadline);
+            if (ready == 0)
+                PyErr_SetString(PyExc_TimeoutError, "the statement was cancelled because the timeout expired");
+            else if (ready > 0 && PQconsumeInput(self->conn) == 0) {
+                PyErr_SetString(PyExc_ConnectionError, PQerrorMessage(self->conn));
+                ready = -1;
+            }
+        }
+        if (ready > 0)
+            continue;
+
+        // don't leave the rest of the rows streaming in
+        Py_BEGIN_ALLOW_THREADS
+        pq_cancel_and_drain(self->conn);
+        close(fd);
+        Py_END_ALLOW_THREADS
+        goto failed;
+    }
+
+    if (close(fd) < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path_arg);
+        PQclear(Connection_get_result(self, deadline));
+        goto failed;
+    }
+
+    PGresult* end = Connection_get_result(self, deadline);
+    if (end == NULL)
+        goto failed;
+    if (PQresultStatus(end) != PGRES_COMMAND_OK) {
+        error_message = PQresultErrorMessage(end);
+        PyErr_SetString(PyExc_ConnectionError, error_message);
+        PQclear(end);
+        goto failed;
+    }
+    const char* tuples = PQcmdTuples(end);
+    int64_t rows = 0;
+    parse_int64(tuples, strlen(tuples), &rows);
+    PQclear(end);
+    Py_DECREF(path);
+    return Py_BuildValue("(LL)", (long long)rows, bytes);
+
+failed:
+    // don't leave a partial file behind that could be mistaken for a complete export
+    unlink(PyBytes_AS_STRING(path));
+    Py_DECREF(path);
+    return NULL;
+}
+
+static PyObject* Connection_notifications(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    char* error_message = NULL;
+
+    // timeout in seconds, None (the default) waits forever, zero does not wait at all
+    PyObject* timeout;
+    if (find_keyword(args, nargs, kwnames, timeout_keywords, "timeout", &timeout) < 0)
+        return NULL;
+    if (nargs)
+        timeout = args[0];
+    double deadline;
+    if (timeout_to_deadline(timeout, &deadline) < 0)
+        return NULL;
+
+    // return anything that has already arrived without waiting, otherwise wait for the socket until a notification
+    // arrives or the deadline passes. Other traffic such as a ParameterStatus message or part of a packet also
+    // makes the socket readable, so keep waiting when nothing was queued
+    for (;;) {
+        if (PQconsumeInput(self->conn) == 0) {
             error_message = PQerrorMessage(self->conn);
             PyErr_SetString(PyExc_ConnectionError, error_message);
             return NULL;
+        }
+        PyObject* batch = Connection_take_notifications((PyObject*)self);
+        if (batch == NULL || PyList_GET_SIZE(batch) > 0 || (deadline >= 0 && deadline <= monotonic_now()))
+            return batch;
+        Py_DECREF(batch);
+
+        if (wait_for_socket(self->conn, 0, deadline) < 0)
+            return NULL;
+    }
+}
+
+static PyObject* Connection_notification_stream(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs) {
+    return NotificationStream_new(get_module_state((PyObject*)self), (PyObject*)self);
+}
+
+// runs LISTEN or UNLISTEN for the cache invalidation channel
+static int Connection_listen(ConnectionObject *self, const char* command, PyObject* channel) {
+    Py_ssize_t size;
+    const char* name = PyUnicode_AsUTF8AndSize(channel, &size);
+    if (name == NULL)
+        return -1;
+    char* identifier = PQescapeIdentifier(self->conn, name, size);
+    if (identifier == NULL) {
+        PyErr_SetString(PyExc_ConnectionError, PQerrorMessage(self->conn));
+        return -1;
     }
+    PyObject* sql = PyUnicode_FromFormat("%s %s", command, identifier);
+    PQfreemem(identifier);
+    if (sql == NULL)
+        return -1;
+
+    // make sure result is cleared (GCC-specific)
+    const char* command_sql = PyUnicode_AsUTF8(sql);
+    if (command_sql == NULL) {
+        Py_DECREF(sql);
+        return -1;
+    }
+    PGresult* res __attribute__((cleanup(free_result))) = NULL;
+    Py_BEGIN_ALLOW_THREADS
+    res = PQexec(self->conn, command_sql);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(sql);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        PyErr_SetString(PyExc_ConnectionError, PQerrorMessage(self->conn));
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject* Connection_disable_cache(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs) {
+    if (self->cache == NULL)
+        Py_RETURN_NONE;
+
+    QueryCache* cache = self->cache;
+    self->cache = NULL;
+    PyObject* channel = QueryCache_channel(cache);
+    int result = channel != NULL && self->conn != NULL ? Connection_listen(self, "UNLISTEN", channel) : 0;
+    QueryCache_free(cache);
+    if (result < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject* Connection_enable_cache(ConnectionObject *self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"max_entries", "ttl", "channel", NULL};
+    Py_ssize_t max_entries = 1024;
+    double ttl = 60.0;
+    PyObject* channel = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|ndO:enable_cache", keywords, &max_entries, &ttl, &channel))
+        return NULL;
+    if (max_entries < 1 || ttl <= 0) {
+        PyErr_SetString(PyExc_ValueError, "max_entries and ttl must be positive");
+        return NULL;
+    }
+    if (channel == Py_None) {
+        channel = NULL;
+    } else if (!PyUnicode_Check(channel)) {
+        PyErr_SetString(PyExc_ValueError, "expected 'channel' to be a string or None");
+        return NULL;
+    }
+
+    // replace any existing cache
+    PyObject* disabled = Connection_disable_cache(self, NULL, 0);
+    if (disabled == NULL)
+        return NULL;
+    Py_DECREF(disabled);
+
+    if (channel != NULL && Connection_listen(self, "LISTEN", channel) < 0)
+        return NULL;
+    self->cache = QueryCache_new(max_entries, ttl, channel);
+    if (self->cache == NULL)
+        return NULL;
     Py_RETURN_NONE;
 }
 
+static PyObject* Connection_clear_cache(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs) {
+    if (self->cache != NULL)
+        QueryCache_clear(self->cache);
+    Py_RETURN_NONE;
+}
 
 static PyObject* Connection_close(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs) {
     PQfinish(self->conn);
     self->conn = NULL;
     Py_RETURN_NONE;
 }
+
+// the methods called from Python hold the connection's lock for the whole call,
+// the functions above assume the caller holds it
+#define LOCKED_FASTCALL(method) \
+    static PyObject* method##_locked(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs) { \
+        if (ConnectionLock_acquire(&self->lock) < 0) \
+            return NULL; \
+        PyObject* result = method(self, args, nargs); \
+        ConnectionLock_release(&self->lock); \
+        return result; \
+    }
+
+#define LOCKED_KEYWORDS(method) \
+    static PyObject* method##_locked(ConnectionObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) { \
+        if (ConnectionLock_acquire(&self->lock) < 0) \
+            return NULL; \
+        PyObject* result = method(self, args, nargs, kwnames); \
+        ConnectionLock_release(&self->lock); \
+        return result; \
+    }
+
+#define LOCKED_VARARGS(method) \
+    static PyObject* method##_locked(ConnectionObject *self, PyObject* args, PyObject* kwargs) { \
+        if (ConnectionLock_acquire(&self->lock) < 0) \
+            return NULL; \
+        PyObject* result = method(self, args, kwargs); \
+        ConnectionLock_release(&self->lock); \
+        return result; \
+    }
+
+LOCKED_FASTCALL(Connection_execute_script)
+LOCKED_KEYWORDS(Connection_execute)
+LOCKED_FASTCALL(Connection_is_busy)
+LOCKED_FASTCALL(Connection_start_execute)
+LOCKED_FASTCALL(Connection_end_execute)
+LOCKED_KEYWORDS(Connection_query)
+LOCKED_KEYWORDS(Connection_start_query)
+LOCKED_FASTCALL(Connection_end_query)
+LOCKED_KEYWORDS(Connection_start_copy)
+LOCKED_FASTCALL(Connection_put_copy_data)
+LOCKED_KEYWORDS(Connection_end_copy)
+LOCKED_KEYWORDS(Connection_query_to_file)
+LOCKED_KEYWORDS(Connection_notifications)
+LOCKED_VARARGS(Connection_enable_cache)
+LOCKED_FASTCALL(Connection_disable_cache)
+LOCKED_FASTCALL(Connection_clear_cache)
+LOCKED_FASTCALL(Connection_close)
+
 //
 // Connection type definition
 //
 
 static PyMethodDef Connection_methods[] = {
-    {"execute_script", (PyCFunction) Connection_execute_script, METH_FASTCALL, "Run a multiple SQL statements, each one must not return any rows."},
-    {"execute", (PyCFunction) Connection_execute, METH_FASTCALL, "Run a SQL statement that does not return any rows, e.g. INSERT, UPDATE or DELETE, and wait for the statement to finish."},    
-    {"is_busy", (PyCFunction) Connection_is_busy, METH_FASTCALL, "Can be checked after calling start_execute or start_query to tell if the command is still running."},
-    {"start_execute", (PyCFunction) Connection_start_execute, METH_FASTCALL, "Starts running a SQL statement but dont wait for the result."},
-    {"end_execute", (PyCFunction) Connection_end_execute, METH_FASTCALL, "Check the result of the previously called start_execute."},
-    {"query", (PyCFunction) Connection_query, METH_FASTCALL, "Run a SQL statement that returns a table of data."},
-    {"start_query", (PyCFunction) Connection_start_query, METH_FASTCALL|METH_KEYWORDS, "Starts running a SQL statement but dont wait for the result."},
-    {"end_query", (PyCFunction) Connection_end_query, METH_FASTCALL, "Create a ForwardCursor for the previous call to start_query."},
-    {"start_copy", (PyCFunction) Connection_start_copy, METH_FASTCALL, "Starts a copy operation using the supplied SQL script."},
-    {"put_copy_data", (PyCFunction) Connection_put_copy_data, METH_FASTCALL, "Sends copy data to the server to for in-progress copy operation"},
-    {"end_copy", (PyCFunction) Connection_end_copy, METH_FASTCALL, "Ends the in-progress copy operation."},
-    {"close", (PyCFunction) Connection_close, METH_FASTCALL, "Closes this connection."},
+    {"execute_script", (PyCFunction) Connection_execute_script_locked, METH_FASTCALL, "Run a multiple SQL statements, each one must not return any rows."},
+    {"execute", (PyCFunction) Connection_execute_locked, METH_FASTCALL|METH_KEYWORDS, "Run a SQL statement that does not return any rows, e.g. INSERT, UPDATE or DELETE, and wait for the statement to finish."},    
+    {"is_busy", (PyCFunction) Connection_is_busy_locked, METH_FASTCALL, "Can be checked after calling start_execute or start_query to tell if the command is still running."},
+    {"start_execute", (PyCFunction) Connection_start_execute_locked, METH_FASTCALL, "Starts running a SQL statement but dont wait for the result."},
+    {"end_execute", (PyCFunction) Connection_end_execute_locked, METH_FASTCALL, "Check the result of the previously called start_execute."},
+    {"query", (PyCFunction) Connection_query_locked, METH_FASTCALL|METH_KEYWORDS, "Run a SQL statement that returns a table of data."},
+    {"start_query", (PyCFunction) Connection_start_query_locked, METH_FASTCALL|METH_KEYWORDS, "Starts running a SQL statement but dont wait for the result."},
+    {"end_query", (PyCFunction) Connection_end_query_locked, METH_FASTCALL, "Create a ForwardCursor for the previous call to start_query."},
+    {"start_copy", (PyCFunction) Connection_start_copy_locked, METH_FASTCALL|METH_KEYWORDS, "Starts a copy operation using the supplied SQL script."},
+    {"put_copy_data", (PyCFunction) Connection_put_copy_data_locked, METH_FASTCALL, "Sends copy data to the server to for in-progress copy operation"},
+    {"end_copy", (PyCFunction) Connection_end_copy_locked, METH_FASTCALL|METH_KEYWORDS, "Ends the in-progress copy operation."},
+    {"query_to_file", (PyCFunction) Connection_query_to_file_locked, METH_FASTCALL|METH_KEYWORDS, "Writes the rows of a query to path as csv, text or binary COPY output, returns (rows, bytes)."},
+    {"notifications", (PyCFunction) Connection_notifications_locked, METH_FASTCALL|METH_KEYWORDS, "Waits up to timeout seconds for LISTEN notifications, returns a list of (channel, pid, payload) tuples."},
+    {"notification_stream", (PyCFunction) Connection_notification_stream, METH_FASTCALL, "Returns an async iterator that yields batches of (channel, pid, payload) tuples as notifications arrive."},
+    {"enable_cache", (PyCFunction) Connection_enable_cache_locked, METH_VARARGS|METH_KEYWORDS, "Cache query() results for up to ttl seconds, keeping at most max_entries. A NOTIFY on channel evicts cached queries whose SQL contains the payload, or all of them for an empty payload. Only SELECT, VALUES, SHOW and TABLE results are cached, including volatile ones such as now() or random()."},
+    {"disable_cache", (PyCFunction) Connection_disable_cache_locked, METH_FASTCALL, "Stops caching query() results and discards the cache."},
+    {"clear_cache", (PyCFunction) Connection_clear_cache_locked, METH_FASTCALL, "Discards all cached query() results."},
+    {"close", (PyCFunction) Connection_close_locked, METH_FASTCALL, "Closes this connection."},
+    {"connect", (PyCFunction) Connection_connect_async, METH_FASTCALL|METH_KEYWORDS|METH_CLASS, "Opens a connection from an asyncio event loop, returns an awaitable of the Connection."},
     {NULL}  /* Sentinel */
 };
 
-
-static PyTypeObject ConnectionType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "pg.Connection",
-    .tp_doc = PyDoc_STR("A Connection to PostgreSQL"),
-    .tp_basicsize = sizeof(ConnectionObject),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_new = PyType_GenericNew,
-    .tp_init = (initproc) Connection_init,
-    .tp_dealloc = (destructor) Connection_dealloc,
-    .tp_methods = Connection_methods,
+static PyType_Slot Connection_slots[] = {
+    {Py_tp_doc, PyDoc_STR("A Connection to PostgreSQL")},
+    {Py_tp_new, Connection_new},
+    {Py_tp_init, Connection_init},
+    {Py_tp_dealloc, Connection_dealloc},
+    {Py_tp_methods, Connection_methods},
+    {0, NULL},
 };
 
-static PyModuleDef ConnectionModule = {
-    PyModuleDef_HEAD_INIT,
-    .m_name = "Connection",
-    .m_doc = "Example module that creates an extension type.",
-    .m_size = -1,
+static PyType_Spec Connection_spec = {
+    .name = "pg.Connection",
+    .basicsize = sizeof(ConnectionObject),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = Connection_slots,
 };
 
-// defined in DataTable.c
-extern PyTypeObject DataTableType;
-extern PyTypeObject ForwardCursorType;
-extern void set_ForwardCursorType_dictoffset();
+//
+// pg module definition, initialised in phases so every (sub-)interpreter gets its own types
+//
 
-PyMODINIT_FUNC PyInit_pg(void) {
-    PyObject *m;
+// defined in the other source files
+extern PyType_Spec DataTable_spec;
+extern PyType_Spec Row_spec;
+extern PyType_Spec ForwardCursor_spec;
+extern PyType_Spec NotificationStream_spec;
+extern PyType_Spec ArrowStream_spec;
+extern PyType_Spec Router_spec;
+extern PyType_Spec ConnectAttempt_spec;
+
+static int pg_create_type(PyObject* module, PyType_Spec* spec, PyTypeObject** type) {
+    *type = (PyTypeObject*)PyType_FromModuleAndSpec(module, spec, NULL);
+    return *type != NULL ? 0 : -1;
+}
 
-    void set_ForwardCursorType_dictoffset();
+static int pg_add_type(PyObject* module, PyType_Spec* spec, PyTypeObject** type) {
+    if (pg_create_type(module, spec, type) < 0)
+        return -1;
+    return PyModule_AddType(module, *type);
+}
 
-    if (PyType_Ready(&ConnectionType) < 0 || PyType_Ready(&DataTableType) < 0 || PyType_Ready(&ForwardCursorType) < 0)
-        return NULL;
+static int pg_exec(PyObject* module) {
+    ModuleState* state = (ModuleState*)PyModule_GetState(module);
+    if (pg_add_type(module, &Connection_spec, &state->ConnectionType) < 0
+        || pg_add_type(module, &DataTable_spec, &state->DataTableType) < 0
+        || pg_add_type(module, &Row_spec, &state->RowType) < 0
+        || pg_add_type(module, &ForwardCursor_spec, &state->ForwardCursorType) < 0
+        || pg_add_type(module, &NotificationStream_spec, &state->NotificationStreamType) < 0
+        || pg_add_type(module, &ArrowStream_spec, &state->ArrowStreamType) < 0
+        || pg_add_type(module, &Router_spec, &state->RouterType) < 0
+        // internal to Connection.connect(), not part of the module's namespace
+        || pg_create_type(module, &ConnectAttempt_spec, &state->ConnectAttemptType) < 0)
+        return -1;
+    return 0;
+}
 
-    m = PyModule_Create(&ConnectionModule);
-    if (m == NULL)
-        return NULL;
+static int pg_traverse(PyObject* module, visitproc visit, void* arg) {
+    ModuleState* state = (ModuleState*)PyModule_GetState(module);
+    Py_VISIT(state->ConnectionType);
+    Py_VISIT(state->DataTableType);
+    Py_VISIT(state->RowType);
+    Py_VISIT(state->ForwardCursorType);
+    Py_VISIT(state->NotificationStreamType);
+    Py_VISIT(state->ArrowStreamType);
+    Py_VISIT(state->RouterType);
+    Py_VISIT(state->ConnectAttemptType);
+    return 0;
+}
 
-    Py_INCREF(&ConnectionType);
-    if (PyModule_AddObject(m, "Connection", (PyObject *) &ConnectionType) < 0) {
-        Py_DECREF(&ConnectionType);
-        Py_DECREF(m);
-        return NULL;
-    }
+static int pg_clear(PyObject* module) {
+    ModuleState* state = (ModuleState*)PyModule_GetState(module);
+    Py_CLEAR(state->ConnectionType);
+    Py_CLEAR(state->DataTableType);
+    Py_CLEAR(state->RowType);
+    Py_CLEAR(state->ForwardCursorType);
+    Py_CLEAR(state->NotificationStreamType);
+    Py_CLEAR(state->ArrowStreamType);
+    Py_CLEAR(state->RouterType);
+    Py_CLEAR(state->ConnectAttemptType);
+    return 0;
+}
 
-    Py_INCREF(&DataTableType);
-    if (PyModule_AddObject(m, "DataTable", (PyObject *) &DataTableType) < 0) {
-        Py_DECREF(&DataTableType);
-        Py_DECREF(m);
-        return NULL;
-    }
+static void pg_free(void* module) {
+    pg_clear((PyObject*)module);
+}
 
-    Py_INCREF(&ForwardCursorType);
-    if (PyModule_AddObject(m, "ForwardCursor", (PyObject *) &ForwardCursorType) < 0) {
-        Py_DECREF(&ForwardCursorType);
-        Py_DECREF(m);
-        return NULL;
-    }
+static PyMethodDef pg_methods[] = {
+    {"connect_many", (PyCFunction) pg_connect_many, METH_FASTCALL|METH_KEYWORDS, "Opens n connections concurrently, returns a list of Connections."},
+    {NULL}  /* Sentinel */
+};
+
+static PyModuleDef_Slot pg_slots[] = {
+    {Py_mod_exec, pg_exec},
+#ifdef Py_mod_multiple_interpreters
+    // no global Python state, every interpreter can have its own GIL
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+    // connections are protected by their own locks, so free-threaded builds can keep the GIL disabled
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL},
+};
+
+static PyModuleDef ConnectionModule = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "pg",
+    .m_doc = "Example module that creates an extension type.",
+    .m_size = sizeof(ModuleState),
+    .m_methods = pg_methods,
+    .m_slots = pg_slots,
+    .m_traverse = pg_traverse,
+    .m_clear = pg_clear,
+    .m_free = pg_free,
+};
 
-    return m;
-}
\ No newline at end of file
+PyMODINIT_FUNC PyInit_pg(void) {
+    return PyModuleDef_Init(&ConnectionModule);
+}
@@ -1,12 +1,39 @@
-#define PY_SSIZE_T_CLEAN
-#include <Python.h>
+#include "module.h"
 #include <libpq-fe.h>
 
+// defined in Arrow.c
+int arrow_batch_rows(PyObject* const* args, Py_ssize_t nargs, int* batch_rows);
+PyObject* ArrowStream_from_table(PyObject* table, PGresult* res, int batch_rows);
+PyObject* ArrowStream_export_table(PyObject* table, PGresult* res);
+int arrow_requested_schema(PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames);
 
+// defined in Connection.c
+int find_keyword(PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames, const char* const* allowed, const char* name, PyObject** value);
+
+// defined in Lookup.c
+typedef struct LookupSpec LookupSpec;
+LookupSpec* Lookup_spec_new(const PGresult* res, PyObject* keys, PyObject* values);
+void Lookup_spec_free(LookupSpec* spec);
+int Lookup_add_rows(PyObject* dict, const PGresult* res, const LookupSpec* spec, int grouped, PyObject* table, int first_row);
+
+// rows copied out of a SpillStore at a time
+#define DATATABLE_PAGE_ROWS 65536
+
+// defined in Spill.c
+typedef struct SpillStore SpillStore;
+void SpillStore_free(SpillStore* store);
+int SpillStore_rows(const SpillStore* store);
+int SpillStore_spilled(const SpillStore* store);
+char* SpillStore_value(const SpillStore* store, int row, int column);
+int SpillStore_length(const SpillStore* store, int row, int column);
+PGresult* SpillStore_page(const SpillStore* store, const PGresult* schema, int first_row, int rows);
+
+// the result is never modified after the DataTable is created, so it can be read from any thread without a lock
 typedef struct {
     PyObject_HEAD
     /* Type-specific fields go here. */
-    PGresult* res;
+    PGresult* res;      // the rows, or only the columns when spill is set
+    SpillStore* spill;  // the rows of a query(spill_threshold=...), NULL otherwise
 } DataTableObject;
 
 
@@ -16,12 +43,34 @@ static void DataTable_dealloc(DataTableObject *self) {
         PQclear(self->res);
         self->res = NULL;
     }
-    Py_TYPE(self)->tp_free(self);
+    SpillStore_free(self->spill);
+    self->spill = NULL;
+    free_instance((PyObject*)self);
+}
+
+static inline int DataTable_tuples(DataTableObject* self) {
+    return self->spill != NULL ? SpillStore_rows(self->spill) : PQntuples(self->res);
+}
+
+// the number of rows, safe to call without the GIL
+int DataTable_row_count(PyObject* table) {
+    return DataTable_tuples((DataTableObject*)table);
+}
+
+// whether the rows are in a SpillStore rather than the PGresult, safe to call without the GIL
+int DataTable_is_spilled(PyObject* table) {
+    return ((DataTableObject*)table)->spill != NULL;
+}
+
+// rows [first_row, first_row + rows) of a spilled table as a new result, NULL if out of memory. Safe to call without the GIL
+PGresult* DataTable_page(PyObject* table, int first_row, int rows) {
+    DataTableObject* self = (DataTableObject*)table;
+    return SpillStore_page(self->spill, self->res, first_row, rows);
 }
 
 static Py_ssize_t DataTable_len(PyObject *obj) {
     DataTableObject* self = (DataTableObject*)obj;
-    int tuples = PQntuples(self->res);
+    int tuples = DataTable_tuples(self);
     return (Py_ssize_t)tuples;
 }
 
@@ -58,10 +107,192 @@ static PyObject* DataTable_column_index(DataTableObject *self, PyObject* const*
     return PyLong_FromLong(index);
 }
 
+// the text of a cell as a str, the row and column must be in range
+static inline PyObject* DataTable_cell(DataTableObject* self, int row, int column) {
+    if (self->spill != NULL)
+        return PyUnicode_FromStringAndSize(SpillStore_value(self->spill, row, column), SpillStore_length(self->spill, row, column));
+    return PyUnicode_FromStringAndSize(PQgetvalue(self->res, row, column), PQgetlength(self->res, row, column));
+}
+
+//
+// Row, a view of one row of a DataTable. Cells are only decoded when they are read
+//
+
+typedef struct {
+    PyObject_HEAD
+    /* Type-specific fields go here. */
+    DataTableObject* table;
+    int row;
+} RowObject;
+
+static void Row_dealloc(RowObject *self) {
+    Py_CLEAR(self->table);
+    free_instance((PyObject*)self);
+}
+
+static Py_ssize_t Row_len(PyObject *obj) {
+    return PQnfields(((RowObject*)obj)->table->res);
+}
+
+static PyObject* Row_GetItem_sequence(PyObject* obj, Py_ssize_t column) {
+    RowObject* self = (RowObject*)obj;
+    int columns = PQnfields(self->table->res);
+
+    // handle negative columns
+    if (column < 0)
+        column = columns + column;
+
+    if (column < 0 || column >= columns) {
+        PyErr_SetString(PyExc_IndexError, "column is out of range");
+        return NULL;
+    }
+    return DataTable_cell(self->table, self->row, column);
+}
+
+static PyObject* Row_GetItem(PyObject* obj, PyObject* key) {
+    RowObject* self = (RowObject*)obj;
+
+    if (PyUnicode_Check(key)) {
+        const char* name = PyUnicode_AsUTF8(key);
+        if (name == NULL)
+            return NULL;
+        int column = PQfnumber(self->table->res, name);
+        if (column < 0) {
+            PyErr_Format(PyExc_KeyError, "column name not found: '%s'", name);
+            return NULL;
+        }
+        return DataTable_cell(self->table, self->row, column);
+    }
+
+    if (PyLong_Check(key)) {
+        Py_ssize_t column = PyNumber_AsSsize_t(key, PyExc_IndexError);
+        if (column == -1 && PyErr_Occurred())
+            return NULL;
+        return Row_GetItem_sequence(obj, column);
+    }
+
+    // a slice is a list of the selected cells, as when rows were lists
+    if (PySlice_Check(key)) {
+        Py_ssize_t start, stop, step;
+        if (PySlice_Unpack(key, &start, &stop, &step) < 0)
+            return NULL;
+        Py_ssize_t count = PySlice_AdjustIndices(PQnfields(self->table->res), &start, &stop, step);
+        PyObject* list = PyList_New(count);
+        if (list == NULL)
+            return NULL;
+        for (Py_ssize_t i = 0, column = start; i < count; i++, column += step) {
+            PyObject* value = DataTable_cell(self->table, self->row, (int)column);
+            if (value == NULL) {
+                Py_DECREF(list);
+                return NULL;
+            }
+            PyList_SET_ITEM(list, i, value);
+        }
+        return list;
+    }
+
+    PyErr_SetString(PyExc_TypeError, "Expected column index, name or slice");
+    return NULL;
+}
+
+// the cells as a list of str, what indexing a DataTable by row used to return
+static PyObject* Row_to_list(RowObject *self, PyObject* ignored) {
+    int columns = PQnfields(self->table->res);
+    PyObject* list = PyList_New(columns);
+    if (list == NULL)
+        return NULL;
+    for (int i = 0; i < columns; i++)
+    {
+        PyObject* value = DataTable_cell(self->table, self->row, i);
+        if (value == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, value);
+    }
+    return list;
+}
+
+// compares equal to a list (or Row) of the same strings
+static PyObject* Row_richcompare(PyObject* obj, PyObject* other, int op) {
+    if (op != Py_EQ && op != Py_NE)
+        Py_RETURN_NOTIMPLEMENTED;
+    PyObject* list = Row_to_list((RowObject*)obj, NULL);
+    if (list == NULL)
+        return NULL;
+    PyObject* other_list = Py_TYPE(other) == Py_TYPE(obj) ? Row_to_list((RowObject*)other, NULL) : Py_NewRef(other);
+    PyObject* result = other_list != NULL ? PyObject_RichCompare(list, other_list, op) : NULL;
+    Py_DECREF(list);
+    Py_XDECREF(other_list);
+    return result;
+}
+
+static PyObject* Row_repr(RowObject *self) {
+    PyObject* list = Row_to_list(self, NULL);
+    if (list == NULL)
+        return NULL;
+    PyObject* repr = PyUnicode_FromFormat("Row(%R)", list);
+    Py_DECREF(list);
+    return repr;
+}
+
+static PyMethodDef Row_methods[] = {
+    {"to_list", (PyCFunction) Row_to_list, METH_NOARGS, "Returns the values of every column as a list of strings."},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot Row_slots[] = {
+    {Py_tp_doc, PyDoc_STR("A row of a DataTable, index by column number or name")},
+    {Py_tp_dealloc, Row_dealloc},
+    {Py_tp_repr, Row_repr},
+    {Py_tp_richcompare, Row_richcompare},
+    {Py_tp_methods, Row_methods},
+    {Py_mp_length, Row_len},
+    {Py_mp_subscript, Row_GetItem},
+    {Py_sq_length, Row_len},
+    {Py_sq_item, Row_GetItem_sequence},
+    {0, NULL},
+};
+
+PyType_Spec Row_spec = {
+    .name = "pg.Row",
+    .basicsize = sizeof(RowObject),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = Row_slots,
+};
+
+// a view of a row of the table, the row must be in range
+PyObject* DataTable_row(PyObject* table, int row) {
+    RowObject* obj = PyObject_New(RowObject, get_module_state(table)->RowType);
+    if (obj == NULL)
+        return NULL;
+    obj->table = (DataTableObject*)Py_NewRef(table);
+    obj->row = row;
+    return (PyObject*)obj;
+}
+
+static PyObject* DataTable_GetItem_sequence(PyObject* obj, Py_ssize_t row) {
+    DataTableObject* self = (DataTableObject*)obj;
+
+    int tuples = DataTable_tuples(self);
+    
+    // handle negative rows
+    if (row < 0)
+        row = tuples + row;
+
+    // IndexError ends iteration
+    if (row < 0 || row >= tuples) {
+        PyErr_SetString(PyExc_IndexError, "row is out of range");
+        return NULL;
+    }
+    return DataTable_row(obj, row);
+}
+
 static PyObject* DataTable_GetItem(PyObject* obj, PyObject* key) {
     DataTableObject* self = (DataTableObject*)obj;
 
-    int tuples = PQntuples(self->res);
+    int tuples = DataTable_tuples(self);
     int columns = PQnfields(self->res);
 
     if (PyTuple_Check(key)) {
@@ -88,55 +319,80 @@ static PyObject* DataTable_GetItem(PyObject* obj, PyObject* key) {
         }
 
         // return the string at row,column 
-        char* value = PQgetvalue(self->res, row, column);
-        return PyUnicode_FromString(value);
+        return DataTable_cell(self, row, column);
     }
 
     if (PyLong_Check(key)) {
-        long row = PyLong_AsLong(key);
-
-        // handle negative rows
-        if (row < 0)
-            row = tuples + row;
-
-        if (row < 0 || row >= tuples) {
-            PyErr_SetString(PyExc_ValueError, "row is out of range (1)");
+        Py_ssize_t row = PyNumber_AsSsize_t(key, PyExc_IndexError);
+        if (row == -1 && PyErr_Occurred())
             return NULL;
-        }
-
-        PyObject* list = PyList_New(columns);
-        for (int i = 0; i < columns; i++)
-        {
-            char* value = PQgetvalue(self->res, row, i);
-            PyList_SetItem(list, i, PyUnicode_FromString(value));
-        }
-        return list;
+        // IndexError like iteration and Row
+        return DataTable_GetItem_sequence(obj, row);
     }
 
     PyErr_SetString(PyExc_ValueError, "Expected row index, or (row, column)");
     return NULL;
 }
 
-static PyObject* DataTable_GetItem_sequence(PyObject* obj, Py_ssize_t row) {
-    DataTableObject* self = (DataTableObject*)obj;
+static PyObject* DataTable_to_arrow(DataTableObject *self, PyObject* const* args, Py_ssize_t nargs) {
+    int batch_rows;
+    if (arrow_batch_rows(args, nargs, &batch_rows) < 0)
+        return NULL;
+    return ArrowStream_from_table((PyObject*)self, self->res, batch_rows);
+}
 
-    int tuples = PQntuples(self->res);
-    
-    // handle negative rows
-    if (row < 0)
-        row = tuples - row;
+static PyObject* DataTable_arrow_c_stream(DataTableObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    if (arrow_requested_schema(args, nargs, kwnames) < 0)
+        return NULL;
+    return ArrowStream_export_table((PyObject*)self, self->res);
+}
 
-    if (row < 0 || row >= tuples)
+static PyObject* DataTable_lookup(DataTableObject *self, PyObject* keys, PyObject* values, int grouped) {
+    LookupSpec* spec = Lookup_spec_new(self->res, keys, values);
+    if (spec == NULL)
         return NULL;
+    int tuples = DataTable_tuples(self);
+    PyObject* dict = PyDict_New();
+    if (dict != NULL && self->spill == NULL && Lookup_add_rows(dict, self->res, spec, grouped, (PyObject*)self, 0) < 0)
+        Py_CLEAR(dict);
+    // a spilled table is read a page of rows at a time
+    for (int first_row = 0; dict != NULL && self->spill != NULL && first_row < tuples; first_row += DATATABLE_PAGE_ROWS) {
+        int rows = tuples - first_row < DATATABLE_PAGE_ROWS ? tuples - first_row : DATATABLE_PAGE_ROWS;
+        PGresult* page = DataTable_page((PyObject*)self, first_row, rows);
+        if (page == NULL)
+            PyErr_NoMemory();
+        if (page == NULL || Lookup_add_rows(dict, page, spec, grouped, (PyObject*)self, first_row) < 0)
+            Py_CLEAR(dict);
+        PQclear(page);
+    }
+    Lookup_spec_free(spec);
+    return dict;
+}
 
-    int columns = PQnfields(self->res);
-    PyObject* list = PyList_New(columns);
-    for (int i = 0; i < columns; i++)
-    {
-        char* value = PQgetvalue(self->res, row, i);
-        PyList_SetItem(list, i, PyUnicode_FromString(value));
+static PyObject* DataTable_to_dict(DataTableObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    static const char* const keywords[] = {"key_cols", "value_cols", NULL};
+    PyObject* keys;
+    PyObject* values;
+    if (find_keyword(args, nargs, kwnames, keywords, "key_cols", &keys) < 0
+        || find_keyword(args, nargs, kwnames, keywords, "value_cols", &values) < 0)
+        return NULL;
+    if (nargs > 2) {
+        PyErr_SetString(PyExc_TypeError, "expected at most 2 arguments, 'key_cols' and 'value_cols'");
+        return NULL;
     }
-    return list;
+    if (nargs > 0)
+        keys = args[0];
+    if (nargs > 1)
+        values = args[1];
+    return DataTable_lookup(self, keys, values, 0);
+}
+
+static PyObject* DataTable_group_index(DataTableObject *self, PyObject* const* args, Py_ssize_t nargs) {
+    if (nargs != 1) {
+        PyErr_SetString(PyExc_ValueError, "expected the key column index or name, or a list of them.");
+        return NULL;
+    }
+    return DataTable_lookup(self, args[0], NULL, 1);
 }
 
 //
@@ -147,36 +403,51 @@ static PyMethodDef DataTable_methods[] = {
     {"column_count", (PyCFunction) DataTable_column_count, METH_FASTCALL, "The number of columns in the table."},
     {"column_name", (PyCFunction) DataTable_column_name, METH_FASTCALL, "Returns the name of a column using the supplied column index (zero-based)."},
     {"column_index", (PyCFunction) DataTable_column_index, METH_FASTCALL, "Returns the index of a column using the supplied column name."},    
+    {"to_arrow", (PyCFunction) DataTable_to_arrow, METH_FASTCALL, "Returns an ArrowStream of the rows, in record batches of at most batch_rows rows."},
+    {"__arrow_c_stream__", (PyCFunction) DataTable_arrow_c_stream, METH_FASTCALL|METH_KEYWORDS, "Exports the rows as an ArrowArrayStream PyCapsule."},
+    {"to_dict", (PyCFunction) DataTable_to_dict, METH_FASTCALL|METH_KEYWORDS, "Returns a dict of the key_cols values to the value_cols values (the Row if not given), later rows replace earlier rows with the same key."},
+    {"group_index", (PyCFunction) DataTable_group_index, METH_FASTCALL, "Returns a dict of the key column values to the list of Rows with that key."},
     {NULL}  /* Sentinel */
 };
 
-static PyMappingMethods DataTable_mapping_methods = {
-    .mp_length = DataTable_len,
-    .mp_subscript = DataTable_GetItem,
+static PyType_Slot DataTable_slots[] = {
+    {Py_tp_doc, PyDoc_STR("A DataTable to PostgreSQL")},
+    {Py_tp_dealloc, DataTable_dealloc},
+    {Py_tp_methods, DataTable_methods},
+    {Py_mp_length, DataTable_len},
+    {Py_mp_subscript, DataTable_GetItem},
+    {Py_sq_length, DataTable_len},
+    {Py_sq_item, DataTable_GetItem_sequence},
+    {0, NULL},
 };
 
-static PySequenceMethods DataTable_sequence_methods = {
-    .sq_length = DataTable_len,
-    .sq_item = DataTable_GetItem_sequence,
+PyType_Spec DataTable_spec = {
+    .name = "pg.DataTable",
+    .basicsize = sizeof(DataTableObject),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = DataTable_slots,
 };
 
-PyTypeObject DataTableType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "pg.DataTable",
-    .tp_doc = PyDoc_STR("A DataTable to PostgreSQL"),
-    .tp_basicsize = sizeof(DataTableObject),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DISALLOW_INSTANTIATION,
-    .tp_new = NULL,
-    .tp_dealloc = (destructor) DataTable_dealloc,
-    .tp_methods = DataTable_methods,
-    .tp_as_mapping = &DataTable_mapping_methods,
-    .tp_as_sequence = &DataTable_sequence_methods,
-};
-
-// allow the connection to create a data table
-PyObject* DataTable_new(PGresult* res) {
-    DataTableObject* obj = PyObject_New(DataTableObject, &DataTableType);
+// allow the connection to create a data table, takes ownership of the result
+PyObject* DataTable_new(ModuleState* state, PGresult* res) {
+    DataTableObject* obj = PyObject_New(DataTableObject, state->DataTableType);
+    if (obj == NULL) {
+        PQclear(res);
+        return NULL;
+    }
     obj->res = res;
+    obj->spill = NULL;
     return (PyObject*)obj;
 }
+
+// a data table of rows in a SpillStore, res only describes the columns. Takes ownership of both
+PyObject* DataTable_new_spilled(ModuleState* state, PGresult* res, SpillStore* spill) {
+    PyObject* table = DataTable_new(state, res);
+    if (table == NULL) {
+        SpillStore_free(spill);
+        return NULL;
+    }
+    ((DataTableObject*)table)->spill = spill;
+    return table;
+}
@@ -1,24 +1,61 @@
-#define PY_SSIZE_T_CLEAN
-#include <Python.h>
+#include "module.h"
 #include <libpq-fe.h>
-#include <endian.h>
+#include "decode.h"
+
+// defined in Connection.c
+PGconn* Connection_get_conn(PyObject* connection);
+ConnectionLock* Connection_lock(PyObject* connection);
+int pq_wait_result(PGconn* conn, double deadline);
+void pq_cancel_and_drain(PGconn* conn);
+int find_keyword(PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames, const char* const* allowed, const char* name, PyObject** value);
+
+// defined in Aggregate.c
+typedef struct Aggregate Aggregate;
+Aggregate* Aggregate_new(const PGresult* res, const int* group_columns, int group_count, const int* sum_columns, int sum_count, int counts);
+void Aggregate_free(Aggregate* agg);
+int Aggregate_add_rows(Aggregate* agg, const PGresult* res);
+void Aggregate_set_error(Aggregate* agg);
+PyObject* Aggregate_result(Aggregate* agg, const PGresult* res);
+
+// defined in Lookup.c
+typedef struct LookupSpec LookupSpec;
+Py_ssize_t Lookup_columns(const PGresult* res, PyObject* arg, const char* name, int** columns, int* single);
+LookupSpec* Lookup_spec_new(const PGresult* res, PyObject* keys, PyObject* values);
+void Lookup_spec_free(LookupSpec* spec);
+int Lookup_add_rows(PyObject* dict, const PGresult* res, const LookupSpec* spec, int grouped, PyObject* table, int first_row);
+
+// defined in Arrow.c
+int arrow_batch_rows(PyObject* const* args, Py_ssize_t nargs, int* batch_rows);
+PyObject* ArrowStream_from_cursor(PyObject* cursor, int batch_rows);
 
 typedef struct {
     PyObject_HEAD
     /* Type-specific fields go here. */
-    PGconn* conn;
+    PyObject* connection;   // the Connection running the query, its lock is held while the cursor is used
     PGresult* res;
+    double deadline;    // when the query is cancelled, negative for no timeout
+    int timed_out;      // the query was cancelled because the deadline passed
+    int consuming;      // aggregate() or an Arrow stream is moving the cursor without the GIL, see ForwardCursor_begin_consuming
 } ForwardCursorObject;
 
 
 static void ForwardCursor_dealloc(ForwardCursorObject *self) {
     // release the result set
     if (self->res != NULL) {
-        PQconsumeInput(self->conn);
+        ConnectionLock* lock = Connection_lock(self->connection);
+        int held = ConnectionLock_held(lock);
+        if (held || ConnectionLock_acquire(lock) == 0) {
+            PGconn* conn = Connection_get_conn(self->connection);
+            if (conn != NULL)
+                PQconsumeInput(conn);
+            if (!held)
+                ConnectionLock_release(lock);
+        }
         PQclear(self->res);
         self->res = NULL;
     }
-    Py_TYPE(self)->tp_free(self);
+    Py_CLEAR(self->connection);
+    free_instance((PyObject*)self);
 }
 
 static PyObject* ForwardCursor_column_count(ForwardCursorObject *self, PyObject* ignored) {
@@ -135,26 +172,23 @@ static PyObject* ForwardCursor_get_float(ForwardCursorObject *self, PyObject* co
         // binary
         Oid col_type = PQftype(self->res, column);
         switch (col_type) {
-            case 700: {// FLOAT4 
-                union { uint32_t ui; float fp;} swap;
-                uint32_t* value_in_nbo = (uint32_t*) PQgetvalue(self->res, row, column);
-                swap.ui = be32toh(*value_in_nbo);
-                return PyFloat_FromDouble(swap.fp);
-            }
-            case 701: {// FLOAT8 
-                union { uint64_t ui; double fp;} swap;
-                uint64_t* value_in_nbo = (uint64_t*) PQgetvalue(self->res, row, column);
-                swap.ui = be64toh(*value_in_nbo);
-                return PyFloat_FromDouble(swap.fp);
-            }
+            case 700: // FLOAT4 
+                return PyFloat_FromDouble(decode_float4(PQgetvalue(self->res, row, column)));
+            case 701: // FLOAT8 
+                return PyFloat_FromDouble(decode_float8(PQgetvalue(self->res, row, column)));
             default:
                 PyErr_Format(PyExc_ValueError, "Cannot read binary as float for Oid type %i.", col_type);
                 return NULL;
         }
     } else {
         // text
-        char* text = PQgetvalue(self->res, row, column);        
-        return PyFloat_FromDouble(atof(text));
+        char* text = PQgetvalue(self->res, row, column);
+        double value;
+        if (parse_float8(text, PQgetlength(self->res, row, column), &value) < 0) {
+            PyErr_Format(PyExc_ValueError, "Cannot read '%s' as float.", text);
+            return NULL;
+        }
+        return PyFloat_FromDouble(value);
     }
 }
 
@@ -178,24 +212,12 @@ static PyObject* ForwardCursor_get_int(ForwardCursorObject *self, PyObject* cons
         // binary
         Oid col_type = PQftype(self->res, column);
         switch (col_type) {
-            case 21: {// INT2 
-                union { uint16_t ui; short i;} swap;
-                uint16_t* value_in_nbo = (uint16_t*) PQgetvalue(self->res, row, column);
-                swap.ui = be16toh(*value_in_nbo);
-                return PyLong_FromLong(swap.i);
-            }
-            case 23: { // INT4 
-                union { uint32_t ui; int i;} swap;
-                uint32_t* value_in_nbo = (uint32_t*) PQgetvalue(self->res, row, column);
-                swap.ui = be32toh(*value_in_nbo);
-                return PyLong_FromLong(swap.i);
-            }
-            case 20: {// INT8 
-                union { uint64_t ui; long i;} swap;
-                uint64_t* value_in_nbo = (uint64_t*) PQgetvalue(self->res, row, column);
-                swap.ui = be64toh(*value_in_nbo);
-                return PyLong_FromLong(swap.i);
-            }
+            case 21: // INT2 
+                return PyLong_FromLong(decode_int2(PQgetvalue(self->res, row, column)));
+            case 23: // INT4 
+                return PyLong_FromLong(decode_int4(PQgetvalue(self->res, row, column)));
+            case 20: // INT8 
+                return PyLong_FromLongLong(decode_int8(PQgetvalue(self->res, row, column)));
             default:
                 PyErr_Format(PyExc_ValueError, "Cannot read binary as int for Oid type %i.", col_type);
                 return NULL;
@@ -203,7 +225,12 @@ static PyObject* ForwardCursor_get_int(ForwardCursorObject *self, PyObject* cons
     } else {
         // text
         char* text = PQgetvalue(self->res, row, column);
-        return PyLong_FromLong(atol(text));
+        int64_t value;
+        if (parse_int64(text, PQgetlength(self->res, row, column), &value) < 0) {
+            PyErr_Format(PyExc_ValueError, "Cannot read '%s' as int.", text);
+            return NULL;
+        }
+        return PyLong_FromLongLong(value);
     }
 }
 
@@ -289,66 +316,426 @@ static PyObject* ForwardCursor_get_value(ForwardCursorObject *self, PyObject* co
 }
 
 
-static PyObject* ForwardCursor_next_row(ForwardCursorObject *self, PyObject* ignored) {
-    char* error_message;
+// hands the cursor to aggregate() or an Arrow stream, which move it with ForwardCursor_advance without the GIL and so
+// free results the getters might be reading. Until ForwardCursor_end_consuming every other method raises RuntimeError.
+// set in the cursor's critical section with the GIL held, so a getter either finishes first or sees the flag.
+// Returns -1 with an exception set if the cursor is already being consumed
+int ForwardCursor_begin_consuming(PyObject* cursor) {
+    ForwardCursorObject* self = (ForwardCursorObject*)cursor;
+    int busy;
+    PG_BEGIN_CRITICAL_SECTION(self);
+    busy = __atomic_load_n(&self->consuming, __ATOMIC_RELAXED);
+    if (!busy)
+        __atomic_store_n(&self->consuming, 1, __ATOMIC_RELAXED);
+    PG_END_CRITICAL_SECTION();
+    if (busy) {
+        PyErr_SetString(PyExc_RuntimeError, "the cursor is being read by aggregate() or an Arrow stream");
+        return -1;
+    }
+    return 0;
+}
 
+void ForwardCursor_end_consuming(PyObject* cursor) {
+    ForwardCursorObject* self = (ForwardCursorObject*)cursor;
+    PG_BEGIN_CRITICAL_SECTION(self);
+    __atomic_store_n(&self->consuming, 0, __ATOMIC_RELAXED);
+    PG_END_CRITICAL_SECTION();
+}
+
+// raises RuntimeError while the cursor is being consumed, the caller holds the GIL (and the critical section when reading the result)
+static int ForwardCursor_check_idle(ForwardCursorObject *self) {
+    if (__atomic_load_n(&self->consuming, __ATOMIC_RELAXED)) {
+        PyErr_SetString(PyExc_RuntimeError, "the cursor is being read by aggregate() or an Arrow stream");
+        return -1;
+    }
+    return 0;
+}
+
+// reads the next result without using the Python API, so it is safe to call without the GIL. self->res is left
+// alone so getters on other threads can keep reading it, *next is what replaces it (self->res itself when at the end).
+// the caller must hold the cursor's lock. Returns as ForwardCursor_advance
+static int ForwardCursor_fetch(ForwardCursorObject *self, PGresult** next) {
+    *next = self->res;
     if (self->res != NULL) {
+        // stay at the end once the final result has been read
+        ExecStatusType status = PQresultStatus(self->res);
+        if (status == PGRES_TUPLES_OK || status == PGRES_EMPTY_QUERY)
+            return 0;
+    }
+    *next = NULL;
+    if (self->timed_out)
+        return -1;
+    PGconn* conn = Connection_get_conn(self->connection);
+    if (conn == NULL)
+        return -1;
+
+    if (self->deadline >= 0) {
+        switch (pq_wait_result(conn, self->deadline)) {
+            case 0:
+                break;
+            case 1:
+                // don't leave the query running on the server
+                pq_cancel_and_drain(conn);
+                self->timed_out = 1;
+                return -1;
+            default:
+                return -1;
+        }
+    }
+    *next = PQgetResult(conn);
+
+    switch (PQresultStatus(*next)) {
+        case PGRES_SINGLE_TUPLE:
+            return 1;
+        case PGRES_TUPLES_OK:
+        case PGRES_EMPTY_QUERY:
+            // the final result has no rows but still describes the columns, so keep it.
+            // read again, NULL expected
+            PQclear(PQgetResult(conn));
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+static void ForwardCursor_replace(ForwardCursorObject *self, PGresult* next) {
+    if (next != self->res) {
         PQclear(self->res);
+        self->res = next;
     }
-    self->res = PQgetResult(self->conn);
-    
-    ExecStatusType status = PQresultStatus(self->res);
-    switch (status) {
-        case PGRES_SINGLE_TUPLE:        
+}
+
+// moves to the next row without using the Python API, so it is safe to call without the GIL.
+// the caller must hold the cursor's lock and have called ForwardCursor_begin_consuming (aggregate and Arrow batches).
+// Returns 1 when positioned on a row, 0 once all rows have been read, -1 on error (see PQerrorMessage)
+int ForwardCursor_advance(PyObject* cursor) {
+    ForwardCursorObject* self = (ForwardCursorObject*)cursor;
+    PGresult* next;
+    int status = ForwardCursor_fetch(self, &next);
+    ForwardCursor_replace(self, next);
+    return status;
+}
+
+// the current single-row result, or the final zero-row result once all rows have been read
+PGresult* ForwardCursor_result(PyObject* cursor) {
+    return ((ForwardCursorObject*)cursor)->res;
+}
+
+// describes why ForwardCursor_advance failed
+const char* ForwardCursor_error_message(PyObject* cursor) {
+    ForwardCursorObject* self = (ForwardCursorObject*)cursor;
+    if (self->timed_out)
+        return "the query was cancelled because the timeout expired";
+    PGconn* conn = Connection_get_conn(self->connection);
+    if (conn == NULL)
+        return "connection is closed";
+    return PQerrorMessage(conn);
+}
+
+// the lock that must be held while using the cursor, shared with its connection
+ConnectionLock* ForwardCursor_lock(PyObject* cursor) {
+    return Connection_lock(((ForwardCursorObject*)cursor)->connection);
+}
+
+// raises the exception for a failed ForwardCursor_advance
+void ForwardCursor_set_error(PyObject* cursor) {
+    PyObject* type = ((ForwardCursorObject*)cursor)->timed_out ? PyExc_TimeoutError : PyExc_ConnectionError;
+    PyErr_SetString(type, ForwardCursor_error_message(cursor));
+}
+
+// ForwardCursor_advance for a caller holding the GIL, which is released while waiting on the network.
+// the result is swapped once the GIL is held again, in the cursor's critical section on free-threaded builds,
+// so the getters, which don't take the connection's lock, never read a result that is being freed
+static int ForwardCursor_advance_with_gil(ForwardCursorObject *self) {
+    PGresult* next;
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = ForwardCursor_fetch(self, &next);
+    Py_END_ALLOW_THREADS
+    PG_BEGIN_CRITICAL_SECTION(self);
+    ForwardCursor_replace(self, next);
+    PG_END_CRITICAL_SECTION();
+    return status;
+}
+
+static PyObject* ForwardCursor_next_row(ForwardCursorObject *self, PyObject* ignored) {
+    switch (ForwardCursor_advance_with_gil(self)) {
+        case 1:
             Py_RETURN_TRUE;
-        case PGRES_TUPLES_OK:
-        case PGRES_EMPTY_QUERY:        
-            PQconsumeInput(self->conn);
-            self->res = PQgetResult(self->conn); // read again, NULL expected
+        case 0:
             Py_RETURN_FALSE;
         default:
-            error_message = PQerrorMessage(self->conn);
-            PyErr_SetString(PyExc_ConnectionError, error_message);
+            ForwardCursor_set_error((PyObject*)self);
+            return NULL;
+    }
+}
+
+// groups the remaining rows, starting with the current row when the cursor is on one, and sums columns within each group.
+// the rows are read and added up without creating Python objects and with the GIL released
+static PyObject* ForwardCursor_aggregate_rows(ForwardCursorObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    static const char* const keywords[] = {"group_by", "sums", "counts", NULL};
+    PyObject* group_by;
+    PyObject* sums;
+    PyObject* counts_arg;
+    if (find_keyword(args, nargs, kwnames, keywords, "group_by", &group_by) < 0
+        || find_keyword(args, nargs, kwnames, keywords, "sums", &sums) < 0
+        || find_keyword(args, nargs, kwnames, keywords, "counts", &counts_arg) < 0)
+        return NULL;
+    if (nargs > 1) {
+        PyErr_SetString(PyExc_TypeError, "expected only 'group_by' as a positional argument");
+        return NULL;
+    }
+    if (nargs == 1) {
+        if (group_by != NULL) {
+            PyErr_SetString(PyExc_TypeError, "'group_by' was given twice");
             return NULL;
+        }
+        group_by = args[0];
+    }
+    int counts = counts_arg != NULL ? PyObject_IsTrue(counts_arg) : 1;
+    if (counts < 0)
+        return NULL;
+
+    int status = 1;
+    if (self->res == NULL) {
+        // next_row() has not been called yet, read the first row to find out the columns
+        Py_BEGIN_ALLOW_THREADS
+        status = ForwardCursor_advance((PyObject*)self);
+        Py_END_ALLOW_THREADS
+        if (status < 0) {
+            ForwardCursor_set_error((PyObject*)self);
+            return NULL;
+        }
+    } else if (PQresultStatus(self->res) != PGRES_SINGLE_TUPLE) {
+        status = 0;
+    }
+
+    int* group_columns;
+    int* sum_columns;
+    int single;
+    Py_ssize_t group_count = Lookup_columns(self->res, group_by, "group_by", &group_columns, &single);
+    if (group_count < 0)
+        return NULL;
+    Py_ssize_t sum_count = Lookup_columns(self->res, sums, "sums", &sum_columns, &single);
+    if (sum_count < 0) {
+        PyMem_Free(group_columns);
+        return NULL;
     }
+    Aggregate* agg = Aggregate_new(self->res, group_columns, group_count, sum_columns, sum_count, counts);
+    PyMem_Free(group_columns);
+    PyMem_Free(sum_columns);
+    if (agg == NULL)
+        return NULL;
+
+    int added = 0;
+    Py_BEGIN_ALLOW_THREADS
+    while (status == 1) {
+        added = Aggregate_add_rows(agg, self->res);
+        if (added < 0)
+            break;
+        status = ForwardCursor_advance((PyObject*)self);
+    }
+    Py_END_ALLOW_THREADS
+
+    PyObject* result = NULL;
+    if (added < 0)
+        Aggregate_set_error(agg);
+    else if (status < 0)
+        ForwardCursor_set_error((PyObject*)self);
+    else
+        result = Aggregate_result(agg, self->res);
+    Aggregate_free(agg);
+    return result;
 }
 
+static PyObject* ForwardCursor_aggregate(ForwardCursorObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    if (ForwardCursor_begin_consuming((PyObject*)self) < 0)
+        return NULL;
+    PyObject* result = ForwardCursor_aggregate_rows(self, args, nargs, kwnames);
+    ForwardCursor_end_consuming((PyObject*)self);
+    return result;
+}
+
+// builds a dict from the remaining rows, starting with the current row when the cursor is on one
+static PyObject* ForwardCursor_lookup(ForwardCursorObject *self, PyObject* keys, PyObject* values, int grouped) {
+    int status = 1;
+    if (self->res == NULL) {
+        // next_row() has not been called yet, read the first row to find out the columns
+        status = ForwardCursor_advance_with_gil(self);
+        if (status < 0) {
+            ForwardCursor_set_error((PyObject*)self);
+            return NULL;
+        }
+    } else if (PQresultStatus(self->res) != PGRES_SINGLE_TUPLE) {
+        status = 0;
+    }
+
+    LookupSpec* spec = Lookup_spec_new(self->res, keys, values);
+    if (spec == NULL)
+        return NULL;
+    PyObject* dict = PyDict_New();
+    while (dict != NULL && status == 1) {
+        if (Lookup_add_rows(dict, self->res, spec, grouped, NULL, 0) < 0) {
+            Py_CLEAR(dict);
+            break;
+        }
+        status = ForwardCursor_advance_with_gil(self);
+        if (status < 0) {
+            ForwardCursor_set_error((PyObject*)self);
+            Py_CLEAR(dict);
+        }
+    }
+    Lookup_spec_free(spec);
+    return dict;
+}
+
+static PyObject* ForwardCursor_to_dict(ForwardCursorObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    static const char* const keywords[] = {"key_cols", "value_cols", NULL};
+    PyObject* keys;
+    PyObject* values;
+    if (find_keyword(args, nargs, kwnames, keywords, "key_cols", &keys) < 0
+        || find_keyword(args, nargs, kwnames, keywords, "value_cols", &values) < 0)
+        return NULL;
+    if (nargs > 2) {
+        PyErr_SetString(PyExc_TypeError, "expected at most 2 arguments, 'key_cols' and 'value_cols'");
+        return NULL;
+    }
+    if (nargs > 0)
+        keys = args[0];
+    if (nargs > 1)
+        values = args[1];
+    return ForwardCursor_lookup(self, keys, values, 0);
+}
+
+static PyObject* ForwardCursor_group_index(ForwardCursorObject *self, PyObject* const* args, Py_ssize_t nargs) {
+    if (nargs != 1) {
+        PyErr_SetString(PyExc_ValueError, "expected the key column index or name, or a list of them.");
+        return NULL;
+    }
+    return ForwardCursor_lookup(self, args[0], NULL, 1);
+}
+
+static PyObject* ForwardCursor_to_arrow_batches(ForwardCursorObject *self, PyObject* const* args, Py_ssize_t nargs) {
+    int batch_rows;
+    if (arrow_batch_rows(args, nargs, &batch_rows) < 0)
+        return NULL;
+    return ArrowStream_from_cursor((PyObject*)self, batch_rows);
+}
+
+// the methods that read from the connection hold its lock for the whole call, none of them run while the cursor is consumed
+#define LOCKED_NOARGS(method) \
+    static PyObject* method##_locked(ForwardCursorObject *self, PyObject* ignored) { \
+        ConnectionLock* lock = Connection_lock(self->connection); \
+        if (ConnectionLock_acquire(lock) < 0) \
+            return NULL; \
+        PyObject* result = ForwardCursor_check_idle(self) < 0 ? NULL : method(self, ignored); \
+        ConnectionLock_release(lock); \
+        return result; \
+    }
+
+#define LOCKED_KEYWORDS(method) \
+    static PyObject* method##_locked(ForwardCursorObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) { \
+        ConnectionLock* lock = Connection_lock(self->connection); \
+        if (ConnectionLock_acquire(lock) < 0) \
+            return NULL; \
+        PyObject* result = ForwardCursor_check_idle(self) < 0 ? NULL : method(self, args, nargs, kwnames); \
+        ConnectionLock_release(lock); \
+        return result; \
+    }
+
+#define LOCKED_FASTCALL(method) \
+    static PyObject* method##_locked(ForwardCursorObject *self, PyObject* const* args, Py_ssize_t nargs) { \
+        ConnectionLock* lock = Connection_lock(self->connection); \
+        if (ConnectionLock_acquire(lock) < 0) \
+            return NULL; \
+        PyObject* result = ForwardCursor_check_idle(self) < 0 ? NULL : method(self, args, nargs); \
+        ConnectionLock_release(lock); \
+        return result; \
+    }
+
+// the getters only read the cursor's own result, not the PGconn, so they skip the connection's lock (they are called
+// for every value). next_row swaps the result with the GIL held, or in the cursor's critical section without a GIL,
+// and the bulk readers that swap it without the GIL mark the cursor as consumed first
+#define RESULT_NOARGS(method) \
+    static PyObject* method##_guarded(ForwardCursorObject *self, PyObject* ignored) { \
+        PyObject* result; \
+        PG_BEGIN_CRITICAL_SECTION(self); \
+        result = ForwardCursor_check_idle(self) < 0 ? NULL : method(self, ignored); \
+        PG_END_CRITICAL_SECTION(); \
+        return result; \
+    }
+
+#define RESULT_FASTCALL(method) \
+    static PyObject* method##_guarded(ForwardCursorObject *self, PyObject* const* args, Py_ssize_t nargs) { \
+        PyObject* result; \
+        PG_BEGIN_CRITICAL_SECTION(self); \
+        result = ForwardCursor_check_idle(self) < 0 ? NULL : method(self, args, nargs); \
+        PG_END_CRITICAL_SECTION(); \
+        return result; \
+    }
+
+LOCKED_NOARGS(ForwardCursor_next_row)
+RESULT_NOARGS(ForwardCursor_column_count)
+RESULT_FASTCALL(ForwardCursor_column_name)
+RESULT_FASTCALL(ForwardCursor_column_index)
+RESULT_FASTCALL(ForwardCursor_is_null)
+RESULT_FASTCALL(ForwardCursor_get_str)
+RESULT_FASTCALL(ForwardCursor_get_int)
+RESULT_FASTCALL(ForwardCursor_get_float)
+RESULT_FASTCALL(ForwardCursor_get_bool)
+RESULT_FASTCALL(ForwardCursor_get_value)
+LOCKED_FASTCALL(ForwardCursor_to_arrow_batches)
+LOCKED_KEYWORDS(ForwardCursor_aggregate)
+LOCKED_KEYWORDS(ForwardCursor_to_dict)
+LOCKED_FASTCALL(ForwardCursor_group_index)
+
 //
 // ForwardCursor type definition
 //
 
 static PyMethodDef ForwardCursor_methods[] = {
-    {"next_row", (PyCFunction) ForwardCursor_next_row, METH_NOARGS, "Moves the cursor to the next row of data, returns TRUE if there is a next row, FALSE when all rows have been read"},    
-    {"column_count", (PyCFunction) ForwardCursor_column_count, METH_NOARGS, "The number of columns in the table."},
-    {"column_name", (PyCFunction) ForwardCursor_column_name, METH_FASTCALL, "Returns the name of a column using the supplied column index (zero-based)."},
-    {"column_index", (PyCFunction) ForwardCursor_column_index, METH_FASTCALL, "Returns the index of a column using the supplied column name."},    
-    {"is_null", (PyCFunction) ForwardCursor_is_null, METH_FASTCALL, "Returns TRUE if the value in a column is null."},    
-    {"get_str", (PyCFunction) ForwardCursor_get_str, METH_FASTCALL, "Returns the string value of a column, or None if the value is NULL."},    
-    {"get_int", (PyCFunction) ForwardCursor_get_int, METH_FASTCALL, "Returns the integer value of a column, or None if the value is NULL."},    
-    {"get_float", (PyCFunction) ForwardCursor_get_float, METH_FASTCALL, "Returns the float value of a column, or None if the value is NULL."},    
-    {"get_bool", (PyCFunction) ForwardCursor_get_bool, METH_FASTCALL, "Returns the boolean value of a column, or None if the value is NULL."},    
-    {"get_value", (PyCFunction) ForwardCursor_get_value, METH_FASTCALL, "Returns the value of a column, or None if the value is NULL."},    
+    {"next_row", (PyCFunction) ForwardCursor_next_row_locked, METH_NOARGS, "Moves the cursor to the next row of data, returns TRUE if there is a next row, FALSE when all rows have been read"},    
+    {"column_count", (PyCFunction) ForwardCursor_column_count_guarded, METH_NOARGS, "The number of columns in the table."},
+    {"column_name", (PyCFunction) ForwardCursor_column_name_guarded, METH_FASTCALL, "Returns the name of a column using the supplied column index (zero-based)."},
+    {"column_index", (PyCFunction) ForwardCursor_column_index_guarded, METH_FASTCALL, "Returns the index of a column using the supplied column name."},    
+    {"is_null", (PyCFunction) ForwardCursor_is_null_guarded, METH_FASTCALL, "Returns TRUE if the value in a column is null."},    
+    {"get_str", (PyCFunction) ForwardCursor_get_str_guarded, METH_FASTCALL, "Returns the string value of a column, or None if the value is NULL."},    
+    {"get_int", (PyCFunction) ForwardCursor_get_int_guarded, METH_FASTCALL, "Returns the integer value of a column, or None if the value is NULL."},    
+    {"get_float", (PyCFunction) ForwardCursor_get_float_guarded, METH_FASTCALL, "Returns the float value of a column, or None if the value is NULL."},    
+    {"get_bool", (PyCFunction) ForwardCursor_get_bool_guarded, METH_FASTCALL, "Returns the boolean value of a column, or None if the value is NULL."},    
+    {"get_value", (PyCFunction) ForwardCursor_get_value_guarded, METH_FASTCALL, "Returns the value of a column, or None if the value is NULL."},    
+    {"to_arrow_batches", (PyCFunction) ForwardCursor_to_arrow_batches_locked, METH_FASTCALL, "Returns an ArrowStream that reads the remaining rows in record batches of at most batch_rows rows."},
+    {"aggregate", (PyCFunction) ForwardCursor_aggregate_locked, METH_FASTCALL|METH_KEYWORDS, "Groups the remaining rows by the group_by columns, returning a dict of column name to list: the group values, the sums of the sums columns and the number of rows in 'count'."},
+    {"to_dict", (PyCFunction) ForwardCursor_to_dict_locked, METH_FASTCALL|METH_KEYWORDS, "Reads the remaining rows into a dict of the key_cols values to the value_cols values (the whole row as a tuple if not given), later rows replace earlier rows with the same key."},
+    {"group_index", (PyCFunction) ForwardCursor_group_index_locked, METH_FASTCALL, "Reads the remaining rows into a dict of the key column values to the list of rows (as tuples) with that key."},
     {NULL}  /* Sentinel */
 };
 
 
-PyTypeObject ForwardCursorType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "pg.ForwardCursor",
-    .tp_doc = PyDoc_STR("A single record view of results from PostgreSQL, minimises client memory usage"),
-    .tp_basicsize = sizeof(ForwardCursorObject),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DISALLOW_INSTANTIATION,
-    .tp_new = NULL,
-    .tp_dealloc = (destructor) ForwardCursor_dealloc,
-    .tp_methods = ForwardCursor_methods,
+static PyType_Slot ForwardCursor_slots[] = {
+    {Py_tp_doc, PyDoc_STR("A single record view of results from PostgreSQL, minimises client memory usage")},
+    {Py_tp_dealloc, ForwardCursor_dealloc},
+    {Py_tp_methods, ForwardCursor_methods},
+    {0, NULL},
+};
+
+PyType_Spec ForwardCursor_spec = {
+    .name = "pg.ForwardCursor",
+    .basicsize = sizeof(ForwardCursorObject),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = ForwardCursor_slots,
 };
 
 // allow the connection to create a forward cursor
-PyObject* ForwardCursor_new(PGconn* conn) {
-    ForwardCursorObject* obj = PyObject_New(ForwardCursorObject, &ForwardCursorType);
-    obj->conn = conn;
+PyObject* ForwardCursor_new(ModuleState* state, PyObject* connection, double deadline) {
+    ForwardCursorObject* obj = PyObject_New(ForwardCursorObject, state->ForwardCursorType);
+    if (obj == NULL)
+        return NULL;
+    obj->connection = Py_NewRef(connection);
     obj->res = NULL;
+    obj->deadline = deadline;
+    obj->timed_out = 0;
+    obj->consuming = 0;
     return (PyObject*)obj;
 }
-
@@ -0,0 +1,235 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <libpq-fe.h>
+#include "decode.h"
+
+// builds dicts keyed on columns of a result (to_dict and group_index of DataTable and ForwardCursor),
+// and the conversion of values to Python objects they share with ForwardCursor.aggregate
+
+// defined in DataTable.c
+PyObject* DataTable_row(PyObject* table, int row);
+
+// converts a non-NULL value of a column to bool, int, float or str like ForwardCursor.get_value,
+// other binary values are returned as bytes
+PyObject* Lookup_value(const PGresult* res, int column, const char* value, int length) {
+    Oid type = PQftype(res, column);
+    if (PQfformat(res, column)) {
+        switch (type) {
+            case 16: return PyBool_FromLong(value[0]);
+            case 21: return PyLong_FromLong(decode_int2(value));
+            case 23: return PyLong_FromLong(decode_int4(value));
+            case 20: return PyLong_FromLongLong(decode_int8(value));
+            case 700: return PyFloat_FromDouble(decode_float4(value));
+            case 701: return PyFloat_FromDouble(decode_float8(value));
+            case 18: case 19: case 25: case 1042: case 1043: // CHAR, NAME, TEXT, BPCHAR, VARCHAR
+                return PyUnicode_DecodeUTF8(value, length, NULL);
+            default:
+                return PyBytes_FromStringAndSize(value, length);
+        }
+    }
+    switch (type) {
+        case 16:
+            return PyBool_FromLong(length > 0 && value[0] == 't');
+        case 20: case 21: case 23: {
+            int64_t n;
+            if (parse_int64(value, length, &n) == 0)
+                return PyLong_FromLongLong(n);
+            break;
+        }
+        case 700: case 701: {
+            double x;
+            if (parse_float8(value, length, &x) == 0)
+                return PyFloat_FromDouble(x);
+            break;
+        }
+    }
+    return PyUnicode_DecodeUTF8(value, length, NULL);
+}
+
+// the value at row, column, None for NULL
+static PyObject* Lookup_cell(const PGresult* res, int row, int column) {
+    if (PQgetisnull(res, row, column))
+        Py_RETURN_NONE;
+    return Lookup_value(res, column, PQgetvalue(res, row, column), PQgetlength(res, row, column));
+}
+
+// resolves a column index (negative counts from the end) or name, returns -1 with an exception set
+static int Lookup_column(const PGresult* res, PyObject* arg, const char* name) {
+    int columns = PQnfields(res);
+    if (PyLong_Check(arg)) {
+        long column = PyLong_AsLong(arg);
+        if (column == -1 && PyErr_Occurred())
+            return -1;
+        if (column < 0)
+            column = columns + column;
+        if (column < 0 || column >= columns) {
+            PyErr_SetString(PyExc_ValueError, "column is out of range");
+            return -1;
+        }
+        return (int)column;
+    }
+    if (PyUnicode_Check(arg)) {
+        const char* str = PyUnicode_AsUTF8(arg);
+        if (str == NULL)
+            return -1;
+        int column = PQfnumber(res, str);
+        if (column == -1)
+            PyErr_Format(PyExc_ValueError, "column name not found: '%s'", str);
+        return column;
+    }
+    PyErr_Format(PyExc_ValueError, "expected '%s' to be a column index or name, or a list of them", name);
+    return -1;
+}
+
+// resolves a column index or name, or a list of them, returns the number of columns or -1 with an exception set.
+// *single is set when arg is a single column. NULL or None is no columns. *columns must be freed with PyMem_Free
+Py_ssize_t Lookup_columns(const PGresult* res, PyObject* arg, const char* name, int** columns, int* single) {
+    *columns = NULL;
+    *single = 0;
+    if (arg == NULL || arg == Py_None)
+        return 0;
+
+    if (PyLong_Check(arg) || PyUnicode_Check(arg)) {
+        *columns = PyMem_New(int, 1);
+        if (*columns == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        (*columns)[0] = Lookup_column(res, arg, name);
+        if ((*columns)[0] < 0) {
+            PyMem_Free(*columns);
+            *columns = NULL;
+            return -1;
+        }
+        *single = 1;
+        return 1;
+    }
+
+    PyObject* seq = PySequence_Fast(arg, "");
+    if (seq == NULL) {
+        PyErr_Format(PyExc_ValueError, "expected '%s' to be a column index or name, or a list of them", name);
+        return -1;
+    }
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+    *columns = PyMem_New(int, count + 1);
+    if (*columns == NULL) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (Py_ssize_t i = 0; i < count; i++) {
+        int column = Lookup_column(res, PySequence_Fast_GET_ITEM(seq, i), name);
+        if (column < 0) {
+            Py_DECREF(seq);
+            PyMem_Free(*columns);
+            *columns = NULL;
+            return -1;
+        }
+        (*columns)[i] = column;
+    }
+    Py_DECREF(seq);
+    return count;
+}
+
+// the columns that make up the keys and values of a lookup dict
+typedef struct LookupSpec {
+    int* key_columns;
+    Py_ssize_t key_count;
+    int key_single;         // keys are values rather than tuples
+    int* value_columns;
+    Py_ssize_t value_count; // zero for the whole row
+    int value_single;
+} LookupSpec;
+
+void Lookup_spec_free(LookupSpec* spec) {
+    PyMem_Free(spec->key_columns);
+    PyMem_Free(spec->value_columns);
+    PyMem_Free(spec);
+}
+
+// resolves the key and value columns, returns NULL with an exception set
+LookupSpec* Lookup_spec_new(const PGresult* res, PyObject* keys, PyObject* values) {
+    LookupSpec* spec = PyMem_New(LookupSpec, 1);
+    if (spec == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    spec->value_columns = NULL;
+    spec->key_count = Lookup_columns(res, keys, "key_cols", &spec->key_columns, &spec->key_single);
+    if (spec->key_count == 0 && !PyErr_Occurred())
+        PyErr_SetString(PyExc_ValueError, "expected at least one key column");
+    if (spec->key_count > 0)
+        spec->value_count = Lookup_columns(res, values, "value_cols", &spec->value_columns, &spec->value_single);
+    if (spec->key_count <= 0 || spec->value_count < 0) {
+        Lookup_spec_free(spec);
+        return NULL;
+    }
+    return spec;
+}
+
+// the value of a single column, or a tuple of the values of the columns
+static PyObject* Lookup_row_values(const PGresult* res, int row, const int* columns, Py_ssize_t count, int single) {
+    if (single)
+        return Lookup_cell(res, row, columns[0]);
+    PyObject* tuple = PyTuple_New(count);
+    if (tuple == NULL)
+        return NULL;
+    for (Py_ssize_t i = 0; i < count; i++) {
+        PyObject* value = Lookup_cell(res, row, columns != NULL ? columns[i] : (int)i);
+        if (value == NULL) {
+            Py_DECREF(tuple);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(tuple, i, value);
+    }
+    return tuple;
+}
+
+// adds every row of res to dict. When grouped each key maps to a list of values, otherwise later rows replace earlier ones.
+// without value columns the value is the whole row, a Row view of table or a tuple of every column when table is NULL.
+// row i of res is row first_row + i of table
+int Lookup_add_rows(PyObject* dict, const PGresult* res, const LookupSpec* spec, int grouped, PyObject* table, int first_row) {
+    int rows = PQntuples(res);
+    for (int row = 0; row < rows; row++) {
+        PyObject* key = Lookup_row_values(res, row, spec->key_columns, spec->key_count, spec->key_single);
+        if (key == NULL)
+            return -1;
+        PyObject* value;
+        if (spec->value_count > 0)
+            value = Lookup_row_values(res, row, spec->value_columns, spec->value_count, spec->value_single);
+        else if (table != NULL)
+            value = DataTable_row(table, first_row + row);
+        else
+            value = Lookup_row_values(res, row, NULL, PQnfields(res), 0);
+        if (value == NULL) {
+            Py_DECREF(key);
+            return -1;
+        }
+
+        int result;
+        if (!grouped) {
+            result = PyDict_SetItem(dict, key, value);
+        } else {
+            PyObject* list = PyDict_GetItemWithError(dict, key);
+            if (list != NULL) {
+                result = PyList_Append(list, value);
+            } else if (PyErr_Occurred()) {
+                result = -1;
+            } else {
+                list = PyList_New(1);
+                if (list == NULL) {
+                    result = -1;
+                } else {
+                    PyList_SET_ITEM(list, 0, Py_NewRef(value));
+                    result = PyDict_SetItem(dict, key, list);
+                    Py_DECREF(list);
+                }
+            }
+        }
+        Py_DECREF(key);
+        Py_DECREF(value);
+        if (result < 0)
+            return -1;
+    }
+    return 0;
+}
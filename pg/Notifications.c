@@ -0,0 +1,274 @@
+#include "module.h"
+#include <libpq-fe.h>
+
+PGconn* Connection_get_conn(PyObject* connection);
+ConnectionLock* Connection_lock(PyObject* connection);
+PyObject* Connection_take_notifications(PyObject* connection);
+
+// returns every notification libpq has already received as a list of (channel, pid, payload) tuples.
+// the caller must have called PQconsumeInput first, this does not read from the socket
+PyObject* Notifications_drain(PGconn* conn) {
+    PyObject* batch = PyList_New(0);
+    if (batch == NULL)
+        return NULL;
+
+    PGnotify* notify;
+    while ((notify = PQnotifies(conn)) != NULL) {
+        PyObject* item = Py_BuildValue("(sis)", notify->relname, notify->be_pid, notify->extra);
+        PQfreemem(notify);
+        if (item == NULL || PyList_Append(batch, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(batch);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    return batch;
+}
+
+typedef struct {
+    PyObject_HEAD
+    /* Type-specific fields go here. */
+    PyObject* connection;   // the Connection being listened on
+    PyObject* loop;         // event loop the reader is registered with, NULL when not waiting
+    int socket;             // socket the reader is registered for
+    PyObject* waiter;       // future returned by the pending __anext__, NULL when not waiting
+    PyObject* on_readable;  // bound callback passed to loop.add_reader
+} NotificationStreamObject;
+
+static int NotificationStream_traverse(NotificationStreamObject *self, visitproc visit, void *arg) {
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->connection);
+    Py_VISIT(self->loop);
+    Py_VISIT(self->waiter);
+    Py_VISIT(self->on_readable);
+    return 0;
+}
+
+static int NotificationStream_clear(NotificationStreamObject *self) {
+    Py_CLEAR(self->connection);
+    Py_CLEAR(self->loop);
+    Py_CLEAR(self->waiter);
+    Py_CLEAR(self->on_readable);
+    return 0;
+}
+
+static void NotificationStream_dealloc(NotificationStreamObject *self) {
+    PyObject_GC_UnTrack(self);
+    NotificationStream_clear(self);
+    free_instance((PyObject *)self);
+}
+
+// reads the notifications that have arrived on the connection, holding its lock only while libpq is in use
+// so the event loop callbacks run without it. Returns a list, which may be empty, or NULL with an exception set
+static PyObject* NotificationStream_read(NotificationStreamObject *self) {
+    ConnectionLock* lock = Connection_lock(self->connection);
+    if (ConnectionLock_acquire(lock) < 0)
+        return NULL;
+    PyObject* batch = NULL;
+    PGconn* conn = Connection_get_conn(self->connection);
+    if (conn == NULL) {
+        PyErr_SetString(PyExc_ConnectionError, "connection is closed");
+    } else if (PQconsumeInput(conn) == 0) {
+        PyErr_SetString(PyExc_ConnectionError, PQerrorMessage(conn));
+    } else {
+        batch = Connection_take_notifications(self->connection);
+    }
+    ConnectionLock_release(lock);
+    return batch;
+}
+
+// stop watching the socket, the waiter future is left for the caller to complete
+static int NotificationStream_stop_waiting(NotificationStreamObject *self, int fd) {
+    int result = 0;
+    if (self->loop != NULL) {
+        PyObject* removed = PyObject_CallMethod(self->loop, "remove_reader", "i", fd);
+        if (removed == NULL)
+            result = -1;
+        Py_XDECREF(removed);
+        Py_CLEAR(self->loop);
+    }
+    return result;
+}
+
+// returns 1 when the pending waiter has been completed or cancelled, 0 when it is still pending, -1 on error
+static int NotificationStream_waiter_done(NotificationStreamObject *self) {
+    PyObject* done = PyObject_CallMethod(self->waiter, "done", NULL);
+    if (done == NULL)
+        return -1;
+    int is_done = PyObject_IsTrue(done);
+    Py_DECREF(done);
+    return is_done;
+}
+
+// complete the waiter future with either a batch of notifications or the current exception
+static PyObject* NotificationStream_complete(NotificationStreamObject *self, PyObject* batch) {
+    PyObject* waiter = self->waiter;
+    self->waiter = NULL;
+
+    PyObject* result;
+    if (batch != NULL) {
+        result = PyObject_CallMethod(waiter, "set_result", "O", batch);
+    } else {
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        PyErr_NormalizeException(&type, &value, &traceback);
+        result = PyObject_CallMethod(waiter, "set_exception", "O", value);
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(traceback);
+    }
+    Py_DECREF(waiter);
+    return result;
+}
+
+// called by the event loop when the connection's socket is readable
+static PyObject* NotificationStream_on_readable(NotificationStreamObject *self, PyObject* ignored) {
+    int fd = self->socket;
+    int cancelled = self->waiter == NULL ? 1 : NotificationStream_waiter_done(self);
+    if (cancelled < 0)
+        return NULL;
+    if (cancelled) {
+        // the awaiting task was cancelled, leave any notifications queued in libpq for the next __anext__
+        Py_CLEAR(self->waiter);
+        if (NotificationStream_stop_waiting(self, fd) < 0)
+            return NULL;
+        Py_RETURN_NONE;
+    }
+
+    PyObject* batch = NotificationStream_read(self);
+    if (batch != NULL && PyList_GET_SIZE(batch) == 0) {
+        // woken up by something other than a notification, keep waiting
+        Py_DECREF(batch);
+        Py_RETURN_NONE;
+    }
+
+    if (NotificationStream_stop_waiting(self, fd) < 0) {
+        Py_XDECREF(batch);
+        return NULL;
+    }
+    PyObject* result = NotificationStream_complete(self, batch);
+    Py_XDECREF(batch);
+    return result;
+}
+
+static PyMethodDef NotificationStream_on_readable_def = {
+    "_on_readable", (PyCFunction) NotificationStream_on_readable, METH_NOARGS, NULL
+};
+
+static PyObject* NotificationStream_aiter(PyObject *self) {
+    return Py_NewRef(self);
+}
+
+// returns a future that completes with the next batch of notifications
+static PyObject* NotificationStream_anext(NotificationStreamObject *self) {
+    if (self->waiter != NULL) {
+        int done = NotificationStream_waiter_done(self);
+        if (done < 0)
+            return NULL;
+        if (!done) {
+            PyErr_SetString(PyExc_RuntimeError, "another coroutine is already waiting for notifications");
+            return NULL;
+        }
+        // previous wait was cancelled
+        Py_CLEAR(self->waiter);
+        if (NotificationStream_stop_waiting(self, self->socket) < 0)
+            return NULL;
+    }
+    ConnectionLock* lock = Connection_lock(self->connection);
+    if (ConnectionLock_acquire(lock) < 0)
+        return NULL;
+    PGconn* conn = Connection_get_conn(self->connection);
+    int socket = conn != NULL ? PQsocket(conn) : -1;
+    ConnectionLock_release(lock);
+    if (socket < 0) {
+        PyErr_SetString(PyExc_ConnectionError, "connection is closed");
+        return NULL;
+    }
+
+    PyObject* asyncio = PyImport_ImportModule("asyncio");
+    if (asyncio == NULL)
+        return NULL;
+    PyObject* loop = PyObject_CallMethod(asyncio, "get_running_loop", NULL);
+    Py_DECREF(asyncio);
+    if (loop == NULL)
+        return NULL;
+
+    PyObject* future = PyObject_CallMethod(loop, "create_future", NULL);
+    if (future == NULL) {
+        Py_DECREF(loop);
+        return NULL;
+    }
+
+    // notifications may have arrived while the previous batch was being processed
+    PyObject* batch = NotificationStream_read(self);
+    if (batch == NULL)
+        goto error;
+    if (PyList_GET_SIZE(batch) > 0) {
+        PyObject* set = PyObject_CallMethod(future, "set_result", "O", batch);
+        Py_DECREF(batch);
+        if (set == NULL)
+            goto error;
+        Py_DECREF(set);
+        Py_DECREF(loop);
+        return future;
+    }
+    Py_DECREF(batch);
+
+    // nothing pending, wait for the socket to become readable
+    if (self->on_readable == NULL) {
+        self->on_readable = PyCFunction_New(&NotificationStream_on_readable_def, (PyObject*)self);
+        if (self->on_readable == NULL)
+            goto error;
+    }
+    self->socket = socket;
+    PyObject* added = PyObject_CallMethod(loop, "add_reader", "iO", self->socket, self->on_readable);
+    if (added == NULL)
+        goto error;
+    Py_DECREF(added);
+
+    self->loop = loop;
+    self->waiter = Py_NewRef(future);
+    return future;
+
+error:
+    Py_DECREF(future);
+    Py_DECREF(loop);
+    return NULL;
+}
+
+//
+// NotificationStream type definition
+//
+
+static PyType_Slot NotificationStream_slots[] = {
+    {Py_tp_doc, PyDoc_STR("An async iterator of LISTEN/NOTIFY notifications, each item is a batch of (channel, pid, payload) tuples")},
+    {Py_tp_dealloc, NotificationStream_dealloc},
+    {Py_tp_traverse, NotificationStream_traverse},
+    {Py_tp_clear, NotificationStream_clear},
+    {Py_am_aiter, NotificationStream_aiter},
+    {Py_am_anext, NotificationStream_anext},
+    {0, NULL},
+};
+
+PyType_Spec NotificationStream_spec = {
+    .name = "pg.NotificationStream",
+    .basicsize = sizeof(NotificationStreamObject),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_DISALLOW_INSTANTIATION | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = NotificationStream_slots,
+};
+
+// allow the connection to create a notification stream
+PyObject* NotificationStream_new(ModuleState* state, PyObject* connection) {
+    NotificationStreamObject* obj = PyObject_GC_New(NotificationStreamObject, state->NotificationStreamType);
+    if (obj == NULL)
+        return NULL;
+    obj->connection = Py_NewRef(connection);
+    obj->loop = NULL;
+    obj->socket = -1;
+    obj->waiter = NULL;
+    obj->on_readable = NULL;
+    PyObject_GC_Track(obj);
+    return (PyObject*)obj;
+}
@@ -0,0 +1,126 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+double monotonic_now(void);
+
+// client-side cache of query results, owned by a Connection.
+// entries maps (sql, param, ...) -> (expires, DataTable) and is kept in least recently used order,
+// DataTables are immutable so a hit hands out the same object (and the same PGresult)
+typedef struct QueryCache {
+    PyObject* entries;
+    Py_ssize_t max_entries;
+    double ttl;
+    PyObject* channel; // LISTEN channel that invalidates entries, or NULL
+} QueryCache;
+
+QueryCache* QueryCache_new(Py_ssize_t max_entries, double ttl, PyObject* channel) {
+    QueryCache* cache = (QueryCache*)PyMem_Malloc(sizeof(QueryCache));
+    if (cache == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    cache->entries = PyDict_New();
+    if (cache->entries == NULL) {
+        PyMem_Free(cache);
+        return NULL;
+    }
+    cache->max_entries = max_entries;
+    cache->ttl = ttl;
+    cache->channel = Py_XNewRef(channel);
+    return cache;
+}
+
+void QueryCache_free(QueryCache* cache) {
+    Py_DECREF(cache->entries);
+    Py_XDECREF(cache->channel);
+    PyMem_Free(cache);
+}
+
+PyObject* QueryCache_channel(QueryCache* cache) {
+    return cache->channel;
+}
+
+// builds the cache key from the SQL text and the parameters as they are sent to the server
+PyObject* QueryCache_key(PyObject* sql, PyObject** str_args, Py_ssize_t nparams) {
+    PyObject* key = PyTuple_New(nparams + 1);
+    if (key == NULL)
+        return NULL;
+    PyTuple_SET_ITEM(key, 0, Py_NewRef(sql));
+    for (Py_ssize_t i = 0; i < nparams; i++) {
+        PyTuple_SET_ITEM(key, i + 1, Py_NewRef(str_args[i]));
+    }
+    return key;
+}
+
+// returns a new reference to the cached DataTable, or NULL (without an exception) on a miss
+PyObject* QueryCache_get(QueryCache* cache, PyObject* key) {
+    PyObject* entry = PyDict_GetItemWithError(cache->entries, key);
+    if (entry == NULL)
+        return NULL;
+
+    Py_INCREF(entry);
+    double expires = PyFloat_AS_DOUBLE(PyTuple_GET_ITEM(entry, 0));
+    PyObject* table = NULL;
+    if (PyDict_DelItem(cache->entries, key) == 0) {
+        if (expires > monotonic_now()) {
+            // re-insert to mark as most recently used
+            if (PyDict_SetItem(cache->entries, key, entry) == 0)
+                table = Py_NewRef(PyTuple_GET_ITEM(entry, 1));
+        }
+    }
+    Py_DECREF(entry);
+    return table;
+}
+
+int QueryCache_put(QueryCache* cache, PyObject* key, PyObject* table) {
+    PyObject* entry = Py_BuildValue("(dO)", monotonic_now() + cache->ttl, table);
+    if (entry == NULL)
+        return -1;
+    int result = PyDict_SetItem(cache->entries, key, entry);
+    Py_DECREF(entry);
+
+    // evict the least recently used entries, which are at the start of the dict
+    while (result == 0 && PyDict_GET_SIZE(cache->entries) > cache->max_entries) {
+        Py_ssize_t pos = 0;
+        PyObject* oldest;
+        PyObject* value;
+        if (!PyDict_Next(cache->entries, &pos, &oldest, &value))
+            break;
+        Py_INCREF(oldest);
+        result = PyDict_DelItem(cache->entries, oldest);
+        Py_DECREF(oldest);
+    }
+    return result;
+}
+
+void QueryCache_clear(QueryCache* cache) {
+    PyDict_Clear(cache->entries);
+}
+
+// drops entries whose SQL contains the payload (e.g. a table name), an empty payload drops everything
+int QueryCache_invalidate(QueryCache* cache, PyObject* payload) {
+    if (PyUnicode_GET_LENGTH(payload) == 0) {
+        PyDict_Clear(cache->entries);
+        return 0;
+    }
+
+    PyObject* stale = PyList_New(0);
+    if (stale == NULL)
+        return -1;
+    Py_ssize_t pos = 0;
+    PyObject* key;
+    PyObject* value;
+    while (PyDict_Next(cache->entries, &pos, &key, &value)) {
+        int found = PySequence_Contains(PyTuple_GET_ITEM(key, 0), payload);
+        if (found < 0 || (found && PyList_Append(stale, key) < 0)) {
+            Py_DECREF(stale);
+            return -1;
+        }
+    }
+    int result = 0;
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(stale) && result == 0; i++) {
+        result = PyDict_DelItem(cache->entries, PyList_GET_ITEM(stale, i));
+    }
+    Py_DECREF(stale);
+    return result;
+}
@@ -0,0 +1,545 @@
+#include "module.h"
+#include <libpq-fe.h>
+#include <string.h>
+
+// defined in Connection.c
+PGconn* Connection_get_conn(PyObject* connection);
+ConnectionLock* Connection_lock(PyObject* connection);
+double monotonic_now(void);
+
+// one of the servers a Router sends statements to
+typedef struct {
+    PyObject* conninfo;     // as passed by the caller
+    PyObject* target;       // conninfo with target_session_attrs added
+    PyObject* connection;   // NULL while the server is down
+    double latency;         // moving average of the seconds a routed call takes, zero until measured
+    int in_flight;          // routed calls that have not returned yet
+    double retry_at;        // when to try connecting again to a server that is down
+} RouterHost;
+
+typedef struct {
+    PyObject_HEAD
+    /* Type-specific fields go here. */
+    RouterHost primary;
+    RouterHost* replicas;
+    Py_ssize_t replica_count;
+    double pin_seconds;         // reads go to the primary for this long after a write, zero to disable
+    double retry_seconds;       // how long a server that is down is left alone before reconnecting
+    double pinned_until;
+    PyObject* query_connections;    // thread id to the connection of its last start_query, used by end_query
+    PyObject* copy_connections;     // thread id to the connection running its COPY, from start_copy to end_copy
+    int closed;
+    ConnectionLock lock;        // protects the fields above, never held while a statement runs
+} RouterObject;
+
+// weight of the latest call in the latency moving average
+static const double latency_alpha = 0.2;
+
+// adds target_session_attrs to a conninfo string or URI, so libpq checks the role of the server when connecting
+static PyObject* router_target(PyObject* conninfo, const char* attrs) {
+    const char* text = PyUnicode_AsUTF8(conninfo);
+    if (text == NULL)
+        return NULL;
+    if (strncmp(text, "postgresql://", 13) == 0 || strncmp(text, "postgres://", 11) == 0)
+        return PyUnicode_FromFormat("%s%starget_session_attrs=%s", text, strchr(text, '?') != NULL ? "&" : "?", attrs);
+    return PyUnicode_FromFormat("%s target_session_attrs=%s", text, attrs);
+}
+
+static int RouterHost_init(RouterHost* host, PyObject* conninfo, const char* attrs) {
+    if (!PyUnicode_Check(conninfo)) {
+        PyErr_SetString(PyExc_ValueError, "expected each connection string to be a string");
+        return -1;
+    }
+    host->conninfo = Py_NewRef(conninfo);
+    host->target = router_target(conninfo, attrs);
+    return host->target != NULL ? 0 : -1;
+}
+
+static void RouterHost_clear(RouterHost* host) {
+    Py_CLEAR(host->conninfo);
+    Py_CLEAR(host->target);
+    Py_CLEAR(host->connection);
+}
+
+// connects to a host that is down, returns -1 with an exception set if the server can't be reached
+static int Router_connect(RouterObject* self, RouterHost* host) {
+    PyObject* type = (PyObject*)get_module_state((PyObject*)self)->ConnectionType;
+    PyObject* connection = PyObject_CallOneArg(type, host->target);
+
+    if (ConnectionLock_acquire(&self->lock) < 0) {
+        Py_XDECREF(connection);
+        return -1;
+    }
+    PyObject* previous = host->connection;
+    if (connection != NULL) {
+        host->connection = connection;
+        host->latency = 0;
+    } else {
+        host->retry_at = monotonic_now() + self->retry_seconds;
+    }
+    ConnectionLock_release(&self->lock);
+    Py_XDECREF(previous);
+    return connection != NULL ? 0 : -1;
+}
+
+// reconnects to the servers that are down once their retry time has passed, replicas that
+// still can't be reached are skipped, an unreachable primary raises ConnectionError
+static int Router_reconnect(RouterObject* self) {
+    RouterHost** due = PyMem_New(RouterHost*, self->replica_count + 1);
+    if (due == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    int count = 0;
+
+    if (ConnectionLock_acquire(&self->lock) < 0) {
+        PyMem_Free(due);
+        return -1;
+    }
+    double now = monotonic_now();
+    for (Py_ssize_t i = -1; i < self->replica_count; i++) {
+        RouterHost* host = i < 0 ? &self->primary : &self->replicas[i];
+        if (host->connection == NULL && host->retry_at <= now) {
+            // claim the reconnect so other threads don't try at the same time
+            host->retry_at = now + self->retry_seconds;
+            due[count++] = host;
+        }
+    }
+    ConnectionLock_release(&self->lock);
+
+    int result = 0;
+    for (int i = 0; i < count && result == 0; i++) {
+        if (Router_connect(self, due[i]) < 0) {
+            if (due[i] == &self->primary)
+                result = -1;
+            else
+                PyErr_Clear();
+        }
+    }
+    PyMem_Free(due);
+    return result;
+}
+
+// chooses the server for a call, the healthy replica with the lowest expected wait for reads,
+// otherwise the primary. Returns a new reference to its connection, or NULL with an exception set
+static PyObject* Router_pick(RouterObject* self, int read, RouterHost** chosen) {
+    if (ConnectionLock_acquire(&self->lock) < 0)
+        return NULL;
+    if (self->closed) {
+        ConnectionLock_release(&self->lock);
+        PyErr_SetString(PyExc_ConnectionError, "the router is closed");
+        return NULL;
+    }
+
+    RouterHost* best = NULL;
+    double best_score = 0;
+    if (read && monotonic_now() >= self->pinned_until) {
+        for (Py_ssize_t i = 0; i < self->replica_count; i++) {
+            RouterHost* host = &self->replicas[i];
+            if (host->connection == NULL)
+                continue;
+            // calls queue on a connection, so the expected wait grows with the calls already running
+            double score = (host->in_flight + 1) * host->latency;
+            if (best == NULL || score < best_score || (score == best_score && host->in_flight < best->in_flight)) {
+                best = host;
+                best_score = score;
+            }
+        }
+    }
+    if (best == NULL)
+        best = &self->primary;
+
+    PyObject* connection = NULL;
+    if (best->connection == NULL) {
+        PyErr_SetString(PyExc_ConnectionError, "the primary server is unavailable");
+    } else {
+        best->in_flight++;
+        connection = Py_NewRef(best->connection);
+        *chosen = best;
+    }
+    ConnectionLock_release(&self->lock);
+    return connection;
+}
+
+// whether a call failed because the connection to the server was lost
+static int Router_connection_lost(PyObject* connection) {
+    ConnectionLock* lock = Connection_lock(connection);
+    if (ConnectionLock_held(lock))
+        return 0;
+    PyObject *type, *value, *traceback;
+    PyErr_Fetch(&type, &value, &traceback);
+    int lost = 0;
+    if (ConnectionLock_acquire(lock) == 0) {
+        PGconn* conn = Connection_get_conn(connection);
+        lost = conn == NULL || PQstatus(conn) == CONNECTION_BAD;
+        ConnectionLock_release(lock);
+    }
+    PyErr_Restore(type, value, traceback);
+    return lost;
+}
+
+// records the outcome of a call, returns 1 if the server was marked down because its connection was lost
+static int Router_done(RouterObject* self, RouterHost* host, PyObject* connection, double started, int ok, int write) {
+    int lost = !ok && Router_connection_lost(connection);
+
+    // the router's lock is only held briefly and never around a call into Python, so this can't fail
+    PyObject* stale = NULL;
+    ConnectionLock_acquire_detached(&self->lock);
+    double now = monotonic_now();
+    host->in_flight--;
+    if (ok) {
+        double elapsed = now - started;
+        host->latency = host->latency == 0 ? elapsed : latency_alpha * elapsed + (1 - latency_alpha) * host->latency;
+        if (write && self->pin_seconds > 0)
+            self->pinned_until = now + self->pin_seconds;
+    }
+    if (lost && host->connection == connection) {
+        stale = host->connection;
+        host->connection = NULL;
+        // the primary is needed by every write, so try it again straight away
+        host->retry_at = host == &self->primary ? now : now + self->retry_seconds;
+    }
+    ConnectionLock_release(&self->lock);
+    Py_XDECREF(stale);
+    return lost;
+}
+
+// runs a Connection method on the server chosen for it, a read that fails because a replica
+// went away is retried once on another server. The connection used is returned in *used when not NULL
+static PyObject* Router_call(RouterObject* self, const char* name, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames, int read, PyObject** used) {
+    if (Router_reconnect(self) < 0)
+        return NULL;
+
+    for (int attempt = 0; ; attempt++) {
+        RouterHost* host;
+        PyObject* connection = Router_pick(self, read, &host);
+        if (connection == NULL)
+            return NULL;
+
+        double started = monotonic_now();
+        PyObject* method = PyObject_GetAttrString(connection, name);
+        PyObject* result = method != NULL ? PyObject_Vectorcall(method, args, nargs, kwnames) : NULL;
+        Py_XDECREF(method);
+
+        int lost = Router_done(self, host, connection, started, result != NULL, !read);
+        if (result == NULL && lost && read && host != &self->primary && attempt == 0) {
+            // reads don't change anything, so they are safe to run again elsewhere
+            Py_DECREF(connection);
+            PyErr_Clear();
+            continue;
+        }
+        if (used != NULL && result != NULL)
+            *used = Py_NewRef(connection);
+        Py_DECREF(connection);
+        return result;
+    }
+}
+
+// remembers the connection a start_query or start_copy of the calling thread ran on, so threads sharing
+// the router each finish their own. Steals the reference to connection
+static int Router_set_pending(RouterObject* self, PyObject** pending, PyObject* connection) {
+    PyObject* thread = PyLong_FromUnsignedLong(PyThread_get_thread_ident());
+    if (thread == NULL || ConnectionLock_acquire(&self->lock) < 0) {
+        Py_XDECREF(thread);
+        Py_DECREF(connection);
+        return -1;
+    }
+    int result = -1;
+    if (*pending == NULL)
+        PyErr_SetString(PyExc_ConnectionError, "the router is closed");
+    else
+        result = PyDict_SetItem(*pending, thread, connection);
+    ConnectionLock_release(&self->lock);
+    Py_DECREF(thread);
+    Py_DECREF(connection);
+    return result;
+}
+
+// the connection remembered for the calling thread, removed when take is set. Returns a new reference,
+// or NULL with an exception set, RuntimeError naming the start method when there is none
+static PyObject* Router_get_pending(RouterObject* self, PyObject** pending, int take, const char* start) {
+    PyObject* thread = PyLong_FromUnsignedLong(PyThread_get_thread_ident());
+    if (thread == NULL || ConnectionLock_acquire(&self->lock) < 0) {
+        Py_XDECREF(thread);
+        return NULL;
+    }
+    PyObject* connection = NULL;
+    if (*pending == NULL) {
+        PyErr_SetString(PyExc_ConnectionError, "the router is closed");
+    } else {
+        connection = Py_XNewRef(PyDict_GetItemWithError(*pending, thread));
+        if (connection != NULL && take && PyDict_DelItem(*pending, thread) < 0)
+            Py_CLEAR(connection);
+    }
+    ConnectionLock_release(&self->lock);
+    Py_DECREF(thread);
+    if (connection == NULL && !PyErr_Occurred())
+        PyErr_Format(PyExc_RuntimeError, "%s has not been called by this thread", start);
+    return connection;
+}
+
+static PyObject* Router_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+    static char* keywords[] = {"primary", "replicas", "pin_seconds", "retry_seconds", NULL};
+    PyObject* primary;
+    PyObject* replicas = NULL;
+    double pin_seconds = 0;
+    double retry_seconds = 5.0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|Odd:Router", keywords, &primary, &replicas, &pin_seconds, &retry_seconds))
+        return NULL;
+    if (pin_seconds < 0 || retry_seconds < 0) {
+        PyErr_SetString(PyExc_ValueError, "pin_seconds and retry_seconds must not be negative");
+        return NULL;
+    }
+    PyObject* replica_list = replicas != NULL ? PySequence_List(replicas) : PyList_New(0);
+    if (replica_list == NULL)
+        return NULL;
+
+    RouterObject* self = (RouterObject*)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        Py_DECREF(replica_list);
+        return NULL;
+    }
+    self->pin_seconds = pin_seconds;
+    self->retry_seconds = retry_seconds;
+    if (ConnectionLock_init(&self->lock) < 0)
+        goto error;
+    self->query_connections = PyDict_New();
+    self->copy_connections = PyDict_New();
+    if (self->query_connections == NULL || self->copy_connections == NULL)
+        goto error;
+
+    self->replicas = PyMem_Calloc(PyList_GET_SIZE(replica_list) + 1, sizeof(RouterHost));
+    if (self->replicas == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    if (RouterHost_init(&self->primary, primary, "read-write") < 0)
+        goto error;
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(replica_list); i++) {
+        self->replica_count++;
+        if (RouterHost_init(&self->replicas[i], PyList_GET_ITEM(replica_list, i), "standby") < 0)
+            goto error;
+    }
+    Py_CLEAR(replica_list);
+
+    // the primary must be reachable, replicas that are down are retried later
+    if (Router_connect(self, &self->primary) < 0)
+        goto error;
+    for (Py_ssize_t i = 0; i < self->replica_count; i++) {
+        if (Router_connect(self, &self->replicas[i]) < 0)
+            PyErr_Clear();
+    }
+    return (PyObject*)self;
+
+error:
+    Py_XDECREF(replica_list);
+    Py_DECREF(self);
+    return NULL;
+}
+
+static void Router_dealloc(RouterObject *self) {
+    RouterHost_clear(&self->primary);
+    for (Py_ssize_t i = 0; i < self->replica_count; i++) {
+        RouterHost_clear(&self->replicas[i]);
+    }
+    PyMem_Free(self->replicas);
+    Py_CLEAR(self->query_connections);
+    Py_CLEAR(self->copy_connections);
+    ConnectionLock_free(&self->lock);
+    free_instance((PyObject *)self);
+}
+
+static PyObject* Router_query(RouterObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    return Router_call(self, "query", args, nargs, kwnames, 1, NULL);
+}
+
+static PyObject* Router_query_to_file(RouterObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    return Router_call(self, "query_to_file", args, nargs, kwnames, 1, NULL);
+}
+
+static PyObject* Router_start_query(RouterObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    PyObject* connection = NULL;
+    PyObject* result = Router_call(self, "start_query", args, nargs, kwnames, 1, &connection);
+    if (result == NULL)
+        return NULL;
+    if (Router_set_pending(self, &self->query_connections, connection) < 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject* Router_end_query(RouterObject *self, PyObject* const* args, Py_ssize_t nargs) {
+    PyObject* connection = Router_get_pending(self, &self->query_connections, 1, "start_query");
+    if (connection == NULL)
+        return NULL;
+    PyObject* cursor = PyObject_CallMethod(connection, "end_query", NULL);
+    Py_DECREF(connection);
+    return cursor;
+}
+
+static PyObject* Router_execute(RouterObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    return Router_call(self, "execute", args, nargs, kwnames, 0, NULL);
+}
+
+static PyObject* Router_execute_script(RouterObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    return Router_call(self, "execute_script", args, nargs, kwnames, 0, NULL);
+}
+
+// a COPY stays on the connection it started on until end_copy, even if the primary is reconnected meanwhile
+static PyObject* Router_start_copy(RouterObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    PyObject* connection = NULL;
+    PyObject* result = Router_call(self, "start_copy", args, nargs, kwnames, 0, &connection);
+    if (result == NULL)
+        return NULL;
+    if (Router_set_pending(self, &self->copy_connections, connection) < 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject* Router_put_copy_data(RouterObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    PyObject* connection = Router_get_pending(self, &self->copy_connections, 0, "start_copy");
+    if (connection == NULL)
+        return NULL;
+    PyObject* method = PyObject_GetAttrString(connection, "put_copy_data");
+    PyObject* result = method != NULL ? PyObject_Vectorcall(method, args, nargs, kwnames) : NULL;
+    Py_XDECREF(method);
+    Py_DECREF(connection);
+    return result;
+}
+
+static PyObject* Router_end_copy(RouterObject *self, PyObject* const* args, Py_ssize_t nargs, PyObject *kwnames) {
+    PyObject* connection = Router_get_pending(self, &self->copy_connections, 1, "start_copy");
+    if (connection == NULL)
+        return NULL;
+    PyObject* method = PyObject_GetAttrString(connection, "end_copy");
+    PyObject* result = method != NULL ? PyObject_Vectorcall(method, args, nargs, kwnames) : NULL;
+    Py_XDECREF(method);
+    Py_DECREF(connection);
+    return result;
+}
+
+static PyObject* Router_primary(RouterObject *self, PyObject* const* args, Py_ssize_t nargs) {
+    if (Router_reconnect(self) < 0 || ConnectionLock_acquire(&self->lock) < 0)
+        return NULL;
+    PyObject* connection = self->closed ? NULL : Py_XNewRef(self->primary.connection);
+    ConnectionLock_release(&self->lock);
+    if (connection == NULL)
+        PyErr_SetString(PyExc_ConnectionError, self->closed ? "the router is closed" : "the primary server is unavailable");
+    return connection;
+}
+
+static PyObject* Router_hosts(RouterObject *self, PyObject* const* args, Py_ssize_t nargs) {
+    PyObject* list = PyList_New(self->replica_count + 1);
+    if (list == NULL || ConnectionLock_acquire(&self->lock) < 0) {
+        Py_XDECREF(list);
+        return NULL;
+    }
+    for (Py_ssize_t i = -1; i < self->replica_count; i++) {
+        RouterHost* host = i < 0 ? &self->primary : &self->replicas[i];
+        PyObject* item = Py_BuildValue("(OsOdi)", host->conninfo, i < 0 ? "primary" : "replica",
+            host->connection != NULL ? Py_True : Py_False, host->latency, host->in_flight);
+        if (item == NULL) {
+            ConnectionLock_release(&self->lock);
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i + 1, item);
+    }
+    ConnectionLock_release(&self->lock);
+    return list;
+}
+
+// closes the connections of a dict of pending start_query or start_copy calls, returns -1 with an exception set
+static int Router_close_pending(PyObject* pending) {
+    int result = 0;
+    PyObject* connection;
+    Py_ssize_t pos = 0;
+    while (pending != NULL && PyDict_Next(pending, &pos, NULL, &connection)) {
+        PyObject* closed = PyObject_CallMethod(connection, "close", NULL);
+        if (closed == NULL)
+            result = -1;
+        Py_XDECREF(closed);
+    }
+    Py_XDECREF(pending);
+    return result;
+}
+
+static PyObject* Router_close(RouterObject *self, PyObject* const* args, Py_ssize_t nargs) {
+    PyObject** connections = PyMem_New(PyObject*, self->replica_count + 1);
+    if (connections == NULL)
+        return PyErr_NoMemory();
+    if (ConnectionLock_acquire(&self->lock) < 0) {
+        PyMem_Free(connections);
+        return NULL;
+    }
+    self->closed = 1;
+    int count = 0;
+    for (Py_ssize_t i = -1; i < self->replica_count; i++) {
+        RouterHost* host = i < 0 ? &self->primary : &self->replicas[i];
+        if (host->connection != NULL)
+            connections[count++] = host->connection;
+        host->connection = NULL;
+    }
+    PyObject* query_connections = self->query_connections;
+    PyObject* copy_connections = self->copy_connections;
+    self->query_connections = NULL;
+    self->copy_connections = NULL;
+    ConnectionLock_release(&self->lock);
+
+    // calls still running hold their own references and finish first
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        PyObject* closed = PyObject_CallMethod(connections[i], "close", NULL);
+        if (closed == NULL)
+            result = -1;
+        Py_XDECREF(closed);
+        Py_DECREF(connections[i]);
+    }
+    PyMem_Free(connections);
+    if (Router_close_pending(query_connections) < 0)
+        result = -1;
+    if (Router_close_pending(copy_connections) < 0)
+        result = -1;
+    if (result < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+//
+// Router type definition
+//
+
+static PyMethodDef Router_methods[] = {
+    {"query", (PyCFunction) Router_query, METH_FASTCALL|METH_KEYWORDS, "Runs Connection.query on the least loaded healthy replica, or the primary when there is none."},
+    {"query_to_file", (PyCFunction) Router_query_to_file, METH_FASTCALL|METH_KEYWORDS, "Runs Connection.query_to_file on the least loaded healthy replica, or the primary when there is none."},
+    {"start_query", (PyCFunction) Router_start_query, METH_FASTCALL|METH_KEYWORDS, "Runs Connection.start_query on the least loaded healthy replica, or the primary when there is none."},
+    {"end_query", (PyCFunction) Router_end_query, METH_FASTCALL, "Create a ForwardCursor for the previous call to start_query on this thread."},
+    {"execute", (PyCFunction) Router_execute, METH_FASTCALL|METH_KEYWORDS, "Runs Connection.execute on the primary."},
+    {"execute_script", (PyCFunction) Router_execute_script, METH_FASTCALL|METH_KEYWORDS, "Runs Connection.execute_script on the primary."},
+    {"start_copy", (PyCFunction) Router_start_copy, METH_FASTCALL|METH_KEYWORDS, "Runs Connection.start_copy on the primary."},
+    {"put_copy_data", (PyCFunction) Router_put_copy_data, METH_FASTCALL|METH_KEYWORDS, "Runs Connection.put_copy_data on the connection start_copy used on this thread."},
+    {"end_copy", (PyCFunction) Router_end_copy, METH_FASTCALL|METH_KEYWORDS, "Runs Connection.end_copy on the connection start_copy used on this thread."},
+    {"primary", (PyCFunction) Router_primary, METH_FASTCALL, "Returns the Connection to the primary, e.g. for LISTEN or a transaction."},
+    {"hosts", (PyCFunction) Router_hosts, METH_FASTCALL, "Returns a (conninfo, role, healthy, latency, in_flight) tuple for the primary and each replica."},
+    {"close", (PyCFunction) Router_close, METH_FASTCALL, "Closes the connections to every server."},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot Router_slots[] = {
+    {Py_tp_doc, PyDoc_STR("Routes reads to replicas and writes to the primary")},
+    {Py_tp_new, Router_new},
+    {Py_tp_dealloc, Router_dealloc},
+    {Py_tp_methods, Router_methods},
+    {0, NULL},
+};
+
+PyType_Spec Router_spec = {
+    .name = "pg.Router",
+    .basicsize = sizeof(RouterObject),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = Router_slots,
+};
@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include <libpq-fe.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// columnar storage for the rows of a query(spill_threshold=...) result.
+// rows are kept in memory until they take more than the threshold, then every column moves to an unlinked
+// temporary file (TMPDIR, /tmp by default) and the rest of the rows are appended there. Once all rows have been
+// read the files are mapped read-only, so the kernel pages the data in and out and the process never holds it all.
+// each column is two buffers: the values, each followed by a NUL like PQgetvalue, and the end offset of every row.
+// nothing here uses the Python API, errors are reported through errno
+
+#define SPILL_NULL (UINT64_C(1) << 63)     // set in a row's end offset when the value is NULL
+#define SPILL_WRITE_BUFFER 65536
+
+typedef struct {
+    char* data;         // the bytes while in memory, the mapping once finished, NULL when empty
+    size_t length;
+    size_t allocated;   // bytes allocated in memory, zero once mapped
+    int fd;             // temporary file once spilled, -1 while in memory and once finished
+    char* pending;      // bytes not yet written to the file
+    size_t pending_length;
+} SpillBuffer;
+
+typedef struct SpillStore {
+    int columns;
+    int rows;
+    size_t threshold;   // bytes held in memory before spilling to files
+    size_t in_memory;   // bytes held in memory so far
+    int spilled;
+    SpillBuffer* ends;  // per column, uint64_t end offset of each row in values
+    SpillBuffer* values;
+} SpillStore;
+
+static void SpillBuffer_free(SpillBuffer* buffer) {
+    if (buffer->allocated == 0 && buffer->data != NULL)
+        munmap(buffer->data, buffer->length);
+    else
+        free(buffer->data);
+    free(buffer->pending);
+    if (buffer->fd >= 0)
+        close(buffer->fd);
+}
+
+void SpillStore_free(SpillStore* store) {
+    if (store == NULL)
+        return;
+    for (int i = 0; i < store->columns; i++) {
+        SpillBuffer_free(&store->ends[i]);
+        SpillBuffer_free(&store->values[i]);
+    }
+    free(store->ends);
+    free(store->values);
+    free(store);
+}
+
+SpillStore* SpillStore_new(int columns, size_t threshold) {
+    SpillStore* store = calloc(1, sizeof(SpillStore));
+    if (store == NULL)
+        return NULL;
+    store->ends = calloc(columns ? columns : 1, sizeof(SpillBuffer));
+    store->values = calloc(columns ? columns : 1, sizeof(SpillBuffer));
+    if (store->ends == NULL || store->values == NULL) {
+        free(store->ends);
+        free(store->values);
+        free(store);
+        return NULL;
+    }
+    store->columns = columns;
+    store->threshold = threshold;
+    for (int i = 0; i < columns; i++) {
+        store->ends[i].fd = -1;
+        store->values[i].fd = -1;
+    }
+    return store;
+}
+
+static int write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// an unlinked temporary file, removed by the kernel once it is closed and unmapped
+static int spill_tempfile(void) {
+    const char* dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == '\0')
+        dir = "/tmp";
+    size_t length = strlen(dir) + sizeof("/pg-spill-XXXXXX");
+    char* path = malloc(length);
+    if (path == NULL)
+        return -1;
+    snprintf(path, length, "%s/pg-spill-XXXXXX", dir);
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd >= 0)
+        unlink(path);
+    free(path);
+    return fd;
+}
+
+// moves a buffer from memory to a temporary file
+static int SpillBuffer_spill(SpillBuffer* buffer) {
+    buffer->pending = malloc(SPILL_WRITE_BUFFER);
+    if (buffer->pending == NULL)
+        return -1;
+    buffer->fd = spill_tempfile();
+    if (buffer->fd < 0 || write_all(buffer->fd, buffer->data, buffer->length) < 0)
+        return -1;
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->allocated = 0;
+    return 0;
+}
+
+static int SpillStore_spill(SpillStore* store) {
+    store->spilled = 1;
+    for (int i = 0; i < store->columns; i++) {
+        if (SpillBuffer_spill(&store->ends[i]) < 0 || SpillBuffer_spill(&store->values[i]) < 0)
+            return -1;
+    }
+    store->in_memory = 0;
+    return 0;
+}
+
+static int SpillBuffer_append(SpillStore* store, SpillBuffer* buffer, const void* data, size_t length) {
+    if (buffer->fd >= 0) {
+        if (buffer->pending_length + length > SPILL_WRITE_BUFFER) {
+            if (write_all(buffer->fd, buffer->pending, buffer->pending_length) < 0)
+                return -1;
+            buffer->pending_length = 0;
+        }
+        if (length > SPILL_WRITE_BUFFER) {
+            if (write_all(buffer->fd, data, length) < 0)
+                return -1;
+        } else {
+            memcpy(buffer->pending + buffer->pending_length, data, length);
+            buffer->pending_length += length;
+        }
+        buffer->length += length;
+        return 0;
+    }
+
+    if (buffer->length + length > buffer->allocated) {
+        size_t allocated = buffer->allocated ? buffer->allocated : 256;
+        while (allocated < buffer->length + length)
+            allocated *= 2;
+        char* grown = realloc(buffer->data, allocated);
+        if (grown == NULL)
+            return -1;
+        store->in_memory += allocated - buffer->allocated;
+        buffer->data = grown;
+        buffer->allocated = allocated;
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return 0;
+}
+
+// appends a row of res, returns -1 with errno set on failure
+int SpillStore_append_row(SpillStore* store, const PGresult* res, int row) {
+    if (store->rows == INT32_MAX) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    for (int i = 0; i < store->columns; i++) {
+        SpillBuffer* values = &store->values[i];
+        uint64_t end = values->length;
+        if (PQgetisnull(res, row, i)) {
+            end |= SPILL_NULL;
+        } else {
+            // keep the NUL that follows every value, so a value can be used as a C string like PQgetvalue
+            if (SpillBuffer_append(store, values, PQgetvalue(res, row, i), PQgetlength(res, row, i) + 1) < 0)
+                return -1;
+            end = values->length;
+        }
+        if (SpillBuffer_append(store, &store->ends[i], &end, sizeof(end)) < 0)
+            return -1;
+    }
+    store->rows++;
+    if (!store->spilled && store->in_memory > store->threshold)
+        return SpillStore_spill(store);
+    return 0;
+}
+
+static int SpillBuffer_finish(SpillBuffer* buffer) {
+    if (buffer->fd < 0)
+        return 0;
+    if (write_all(buffer->fd, buffer->pending, buffer->pending_length) < 0)
+        return -1;
+    free(buffer->pending);
+    buffer->pending = NULL;
+    if (buffer->length > 0) {
+        void* map = mmap(NULL, buffer->length, PROT_READ, MAP_SHARED, buffer->fd, 0);
+        if (map == MAP_FAILED)
+            return -1;
+        buffer->data = map;
+    }
+    close(buffer->fd);
+    buffer->fd = -1;
+    return 0;
+}
+
+// called once every row has been appended, maps the spilled files. Returns -1 with errno set on failure
+int SpillStore_finish(SpillStore* store) {
+    for (int i = 0; i < store->columns; i++) {
+        if (SpillBuffer_finish(&store->ends[i]) < 0 || SpillBuffer_finish(&store->values[i]) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int SpillStore_rows(const SpillStore* store) {
+    return store->rows;
+}
+
+// whether the rows were moved to files
+int SpillStore_spilled(const SpillStore* store) {
+    return store->spilled;
+}
+
+static inline void SpillStore_bounds(const SpillStore* store, int row, int column, uint64_t* start, uint64_t* end) {
+    const uint64_t* ends = (const uint64_t*)store->ends[column].data;
+    *end = ends[row];
+    *start = row > 0 ? ends[row - 1] & ~SPILL_NULL : 0;
+}
+
+// the accessors match PQgetisnull, PQgetvalue and PQgetlength, the row and column must be in range
+int SpillStore_isnull(const SpillStore* store, int row, int column) {
+    return (((const uint64_t*)store->ends[column].data)[row] & SPILL_NULL) != 0;
+}
+
+char* SpillStore_value(const SpillStore* store, int row, int column) {
+    uint64_t start, end;
+    SpillStore_bounds(store, row, column, &start, &end);
+    if (end & SPILL_NULL)
+        return "";
+    return store->values[column].data + start;
+}
+
+int SpillStore_length(const SpillStore* store, int row, int column) {
+    uint64_t start, end;
+    SpillStore_bounds(store, row, column, &start, &end);
+    if (end & SPILL_NULL)
+        return 0;
+    return (int)(end - start - 1);
+}
+
+// copies rows [first_row, first_row + rows) into a new result with the columns of schema, for code that reads a PGresult.
+// returns NULL if out of memory
+PGresult* SpillStore_page(const SpillStore* store, const PGresult* schema, int first_row, int rows) {
+    PGresult* page = PQcopyResult(schema, PG_COPYRES_ATTRS);
+    if (page == NULL)
+        return NULL;
+    // PQsetvalue adds a row when it is given the next row number
+    for (int row = 0; row < rows; row++) {
+        for (int column = 0; column < store->columns; column++) {
+            int source = first_row + row;
+            int length = SpillStore_isnull(store, source, column) ? -1 : SpillStore_length(store, source, column);
+            if (!PQsetvalue(page, row, column, SpillStore_value(store, source, column), length)) {
+                PQclear(page);
+                return NULL;
+            }
+        }
+    }
+    return page;
+}
@@ -0,0 +1,332 @@
+#define _GNU_SOURCE // strtod_l
+#include "decode.h"
+#include <locale.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DECODE_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define DECODE_NEON 1
+#endif
+
+typedef void (*bswap_func)(uint8_t* data, size_t count, int width);
+
+static void bswap_scalar(uint8_t* data, size_t count, int width) {
+    switch (width) {
+        case 2:
+            for (size_t i = 0; i < count; i++) {
+                uint16_t v;
+                memcpy(&v, data + i * 2, 2);
+                v = be16toh(v);
+                memcpy(data + i * 2, &v, 2);
+            }
+            break;
+        case 4:
+            for (size_t i = 0; i < count; i++) {
+                uint32_t v;
+                memcpy(&v, data + i * 4, 4);
+                v = be32toh(v);
+                memcpy(data + i * 4, &v, 4);
+            }
+            break;
+        case 8:
+            for (size_t i = 0; i < count; i++) {
+                uint64_t v;
+                memcpy(&v, data + i * 8, 8);
+                v = be64toh(v);
+                memcpy(data + i * 8, &v, 8);
+            }
+            break;
+    }
+}
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+
+// byte shuffle pattern that reverses each value of the given width within a 16 byte lane
+static const uint8_t shuffle_masks[9][16] __attribute__((aligned(16))) = {
+    [2] = {1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14},
+    [4] = {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12},
+    [8] = {7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8},
+};
+
+#ifdef DECODE_X86
+
+__attribute__((target("ssse3")))
+static void bswap_ssse3(uint8_t* data, size_t count, int width) {
+    size_t bytes = count * width;
+    size_t i = 0;
+    __m128i mask = _mm_load_si128((const __m128i*)shuffle_masks[width]);
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_shuffle_epi8(v, mask));
+    }
+    bswap_scalar(data + i, (bytes - i) / width, width);
+}
+
+__attribute__((target("avx2")))
+static void bswap_avx2(uint8_t* data, size_t count, int width) {
+    size_t bytes = count * width;
+    size_t i = 0;
+    // vpshufb shuffles within each 128 bit lane, so the same pattern is used for both lanes
+    __m256i mask = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)shuffle_masks[width]));
+    for (; i + 32 <= bytes; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        _mm256_storeu_si256((__m256i*)(data + i), _mm256_shuffle_epi8(v, mask));
+    }
+    bswap_ssse3(data + i, (bytes - i) / width, width);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void bswap_avx512(uint8_t* data, size_t count, int width) {
+    size_t bytes = count * width;
+    size_t i = 0;
+    __m512i mask = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i*)shuffle_masks[width]));
+    for (; i + 64 <= bytes; i += 64) {
+        __m512i v = _mm512_loadu_si512((const void*)(data + i));
+        _mm512_storeu_si512((void*)(data + i), _mm512_shuffle_epi8(v, mask));
+    }
+    bswap_avx2(data + i, (bytes - i) / width, width);
+}
+
+#endif
+
+#ifdef DECODE_NEON
+
+// NEON is always present on aarch64, no runtime check is needed
+static void bswap_neon(uint8_t* data, size_t count, int width) {
+    size_t bytes = count * width;
+    size_t i = 0;
+    uint8x16_t mask = vld1q_u8(shuffle_masks[width]);
+    for (; i + 16 <= bytes; i += 16) {
+        uint8x16_t v = vld1q_u8(data + i);
+        vst1q_u8(data + i, vqtbl1q_u8(v, mask));
+    }
+    bswap_scalar(data + i, (bytes - i) / width, width);
+}
+
+#endif
+
+static bswap_func select_bswap(void) {
+#if defined(DECODE_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+        return bswap_avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return bswap_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return bswap_ssse3;
+    return bswap_scalar;
+#elif defined(DECODE_NEON)
+    return bswap_neon;
+#else
+    return bswap_scalar;
+#endif
+}
+
+// resolved on first use, racing threads all store the same value
+static bswap_func bswap_impl = NULL;
+
+void decode_bswap_array(void* data, size_t count, int width) {
+    if (width != 2 && width != 4 && width != 8)
+        return;
+    bswap_func impl = __atomic_load_n(&bswap_impl, __ATOMIC_RELAXED);
+    if (impl == NULL) {
+        impl = select_bswap();
+        __atomic_store_n(&bswap_impl, impl, __ATOMIC_RELAXED);
+    }
+    impl((uint8_t*)data, count, width);
+}
+
+#else
+
+// big-endian hosts already use network byte order
+void decode_bswap_array(void* data, size_t count, int width) {
+}
+
+#endif
+
+void decode_binary_column(const PGresult* res, int column, int first_row, int rows, int width, void* out) {
+    uint8_t* dest = (uint8_t*)out;
+
+    // gather the raw big-endian values, libpq stores each value separately
+    for (int i = 0; i < rows; i++) {
+        int row = first_row + i;
+        if (PQgetisnull(res, row, column) || PQgetlength(res, row, column) != width)
+            memset(dest + (size_t)i * width, 0, width);
+        else
+            memcpy(dest + (size_t)i * width, PQgetvalue(res, row, column), width);
+    }
+
+    // then swap the contiguous array in one vectorised pass
+    decode_bswap_array(dest, (size_t)rows, width);
+}
+
+int parse_int64(const char* text, size_t length, int64_t* out) {
+    const char* p = text;
+    const char* end = text + length;
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    if (p == end)
+        return -1;
+
+    // accumulate as a negative number so INT64_MIN does not overflow
+    int64_t value = 0;
+    for (; p < end; p++) {
+        unsigned digit = (unsigned)(*p - '0');
+        if (digit > 9)
+            return -1;
+        if (value < (INT64_MIN + (int64_t)digit) / 10)
+            return -1;
+        value = value * 10 - digit;
+    }
+    if (!negative) {
+        if (value == INT64_MIN)
+            return -1;
+        value = -value;
+    }
+    *out = value;
+    return 0;
+}
+
+// powers of ten that are exactly representable as a double
+static const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// the "C" locale used by the slow path, created on first use
+static locale_t c_locale = (locale_t)0;
+
+static locale_t get_c_locale(void) {
+    locale_t loc = __atomic_load_n(&c_locale, __ATOMIC_ACQUIRE);
+    if (loc == (locale_t)0) {
+        locale_t created = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+        locale_t expected = (locale_t)0;
+        if (__atomic_compare_exchange_n(&c_locale, &expected, created, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            loc = created;
+        } else {
+            // another thread got there first
+            freelocale(created);
+            loc = expected;
+        }
+    }
+    return loc;
+}
+
+int parse_float8(const char* text, size_t length, double* out) {
+    const char* p = text;
+    const char* end = text + length;
+    if (p == end)
+        return -1;
+
+    // only the grammar float4, float8 and numeric are printed in: [sign] digits [. digits] [e [sign] digits],
+    // Infinity, -Infinity and NaN. Anything else strtod would take (hex floats, "inf", whitespace) is rejected
+    int negative = 0;
+    if (*p == '-' || *p == '+') {
+        negative = *p == '-';
+        p++;
+    }
+    if ((size_t)(end - p) == 8 && memcmp(p, "Infinity", 8) == 0) {
+        *out = negative ? -__builtin_inf() : __builtin_inf();
+        return 0;
+    }
+    if (p == text && length == 3 && memcmp(p, "NaN", 3) == 0) {
+        *out = __builtin_nan("");
+        return 0;
+    }
+
+    // fast path (Clinger): when the significand fits in 53 bits and the power of ten is exact,
+    // a single IEEE multiply or divide is correctly rounded
+    uint64_t significand = 0;
+    int digits = 0;
+    int exponent = 0;
+    for (; p < end && (unsigned)(*p - '0') <= 9; p++, digits++) {
+        significand = significand * 10 + (unsigned)(*p - '0');
+    }
+    if (p < end && *p == '.') {
+        p++;
+        for (; p < end && (unsigned)(*p - '0') <= 9; p++, digits++) {
+            significand = significand * 10 + (unsigned)(*p - '0');
+            exponent--;
+        }
+    }
+    if (digits == 0)
+        return -1;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        int exp_negative = 0;
+        if (p < end && (*p == '-' || *p == '+')) {
+            exp_negative = *p == '-';
+            p++;
+        }
+        const char* exponent_start = p;
+        int explicit_exponent = 0;
+        for (; p < end && (unsigned)(*p - '0') <= 9; p++) {
+            if (explicit_exponent < 100000)
+                explicit_exponent = explicit_exponent * 10 + (*p - '0');
+        }
+        if (p == exponent_start)
+            return -1;
+        exponent += exp_negative ? -explicit_exponent : explicit_exponent;
+    }
+    if (p != end)
+        return -1;
+    if (digits <= 19 && significand <= (UINT64_C(1) << 53) && exponent >= -22 && exponent <= 22) {
+        double value = (double)significand;
+        if (exponent < 0)
+            value /= exact_powers_of_ten[-exponent];
+        else
+            value *= exact_powers_of_ten[exponent];
+        *out = negative ? -value : value;
+        return 0;
+    }
+
+    // slow path: long significands and large exponents, the text has already been checked.
+    // strtod_l with the C locale is exact and ignores the process locale's decimal separator
+    char buffer[64];
+    char* copy = length < sizeof(buffer) ? buffer : malloc(length + 1);
+    if (copy == NULL)
+        return -1;
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    char* parsed_end;
+    double value = strtod_l(copy, &parsed_end, get_c_locale());
+    int ok = parsed_end == copy + length;
+    if (copy != buffer)
+        free(copy);
+    if (!ok)
+        return -1;
+    *out = value;
+    return 0;
+}
+
+int parse_int64_column(const PGresult* res, int column, int first_row, int rows, int64_t* out, int* bad_row) {
+    for (int i = 0; i < rows; i++) {
+        int row = first_row + i;
+        if (PQgetisnull(res, row, column)) {
+            out[i] = 0;
+        } else if (parse_int64(PQgetvalue(res, row, column), PQgetlength(res, row, column), out + i) < 0) {
+            *bad_row = row;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int parse_float8_column(const PGresult* res, int column, int first_row, int rows, double* out, int* bad_row) {
+    for (int i = 0; i < rows; i++) {
+        int row = first_row + i;
+        if (PQgetisnull(res, row, column)) {
+            out[i] = 0;
+        } else if (parse_float8(PQgetvalue(res, row, column), PQgetlength(res, row, column), out + i) < 0) {
+            *bad_row = row;
+            return -1;
+        }
+    }
+    return 0;
+}
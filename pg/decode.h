@@ -0,0 +1,64 @@
+#ifndef PG_DECODE_H
+#define PG_DECODE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <libpq-fe.h>
+
+// binary values are big-endian (network byte order) and not guaranteed to be aligned, so copy before swapping
+
+static inline int16_t decode_int2(const char* value) {
+    uint16_t nbo;
+    memcpy(&nbo, value, sizeof(nbo));
+    return (int16_t)be16toh(nbo);
+}
+
+static inline int32_t decode_int4(const char* value) {
+    uint32_t nbo;
+    memcpy(&nbo, value, sizeof(nbo));
+    return (int32_t)be32toh(nbo);
+}
+
+static inline int64_t decode_int8(const char* value) {
+    uint64_t nbo;
+    memcpy(&nbo, value, sizeof(nbo));
+    return (int64_t)be64toh(nbo);
+}
+
+static inline float decode_float4(const char* value) {
+    uint32_t bits = (uint32_t)decode_int4(value);
+    float fp;
+    memcpy(&fp, &bits, sizeof(fp));
+    return fp;
+}
+
+static inline double decode_float8(const char* value) {
+    uint64_t bits = (uint64_t)decode_int8(value);
+    double fp;
+    memcpy(&fp, &bits, sizeof(fp));
+    return fp;
+}
+
+// converts count big-endian values of width bytes (2, 4 or 8) to host byte order in place,
+// using the widest vector byte shuffle the CPU supports (chosen at runtime)
+void decode_bswap_array(void* data, size_t count, int width);
+
+// gathers the binary values of a fixed-width column (int2/int4/int8/float4/float8) for rows
+// [first_row, first_row + rows) into out, in host byte order.  NULL values are written as zero
+void decode_binary_column(const PGresult* res, int column, int first_row, int rows, int width, void* out);
+
+// parses a base 10 integer as PostgreSQL prints it: optional sign then digits, no whitespace.
+// locale-independent, returns 0 on success or -1 if the text is malformed or out of range
+int parse_int64(const char* text, size_t length, int64_t* out);
+
+// parses a floating-point number as PostgreSQL prints it, including NaN, Infinity and -Infinity.
+// locale-independent and correctly rounded, returns 0 on success or -1 if the text is malformed
+int parse_float8(const char* text, size_t length, double* out);
+
+// parses the text values of a column for rows [first_row, first_row + rows) into out.  NULL values are written as zero.
+// returns 0 on success, or -1 with *bad_row set to the first malformed row
+int parse_int64_column(const PGresult* res, int column, int first_row, int rows, int64_t* out, int* bad_row);
+int parse_float8_column(const PGresult* res, int column, int first_row, int rows, double* out, int* bad_row);
+
+#endif
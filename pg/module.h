@@ -0,0 +1,138 @@
+#ifndef PG_MODULE_H
+#define PG_MODULE_H
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+
+// per-module state, each interpreter that imports pg gets its own copy of the types
+typedef struct {
+    PyTypeObject* ConnectionType;
+    PyTypeObject* DataTableType;
+    PyTypeObject* RowType;
+    PyTypeObject* ForwardCursorType;
+    PyTypeObject* NotificationStreamType;
+    PyTypeObject* ArrowStreamType;
+    PyTypeObject* RouterType;
+    PyTypeObject* ConnectAttemptType;
+} ModuleState;
+
+// the state of the module that created obj's type (none of the types can be subclassed)
+static inline ModuleState* get_module_state(PyObject* obj) {
+    return (ModuleState*)PyType_GetModuleState(Py_TYPE(obj));
+}
+
+// ends tp_dealloc of a heap type, each instance holds a reference to its type
+static inline void free_instance(PyObject* obj) {
+    PyTypeObject* type = Py_TYPE(obj);
+    type->tp_free(obj);
+    Py_DECREF(type);
+}
+
+// the thread state attached to the calling thread, NULL if it has none (e.g. a thread started by a C library)
+static inline PyThreadState* attached_thread_state(void) {
+#if PY_VERSION_HEX >= 0x030D0000
+    return PyThreadState_GetUnchecked();
+#elif PY_VERSION_HEX >= 0x030C0000
+    return _PyThreadState_UncheckedGet();
+#else
+    // before 3.12 the current thread state is process wide, not per thread
+    return PyGILState_Check() ? _PyThreadState_UncheckedGet() : NULL;
+#endif
+}
+
+// guards an object's own fields on free-threaded builds, where the GIL no longer does (a no-op before 3.13)
+#if PY_VERSION_HEX >= 0x030D0000
+#define PG_BEGIN_CRITICAL_SECTION(obj) Py_BEGIN_CRITICAL_SECTION(obj)
+#define PG_END_CRITICAL_SECTION() Py_END_CRITICAL_SECTION()
+#else
+#define PG_BEGIN_CRITICAL_SECTION(obj) {
+#define PG_END_CRITICAL_SECTION() }
+#endif
+
+// serialises the use of a PGconn, libpq connections must only be used by one thread at a time.
+// the GIL is released while waiting on the network and free-threaded builds have no GIL at all,
+// so this is what keeps threads sharing a Connection apart. Not reentrant, a thread that tries
+// to take the lock twice gets an error instead of a deadlock
+typedef struct {
+#if PY_VERSION_HEX >= 0x030D0000
+    PyMutex mutex;
+#else
+    PyThread_type_lock mutex;
+#endif
+    unsigned long owner;    // thread holding the lock, zero when free
+} ConnectionLock;
+
+static inline int ConnectionLock_init(ConnectionLock* lock) {
+    lock->owner = 0;
+#if PY_VERSION_HEX >= 0x030D0000
+    memset(&lock->mutex, 0, sizeof(lock->mutex));
+#else
+    lock->mutex = PyThread_allocate_lock();
+    if (lock->mutex == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static inline void ConnectionLock_free(ConnectionLock* lock) {
+#if PY_VERSION_HEX < 0x030D0000
+    if (lock->mutex != NULL) {
+        PyThread_free_lock(lock->mutex);
+        lock->mutex = NULL;
+    }
+#endif
+}
+
+// whether the calling thread holds the lock, does not use the Python API
+static inline int ConnectionLock_held(ConnectionLock* lock) {
+    return __atomic_load_n(&lock->owner, __ATOMIC_RELAXED) == PyThread_get_thread_ident();
+}
+
+// takes the lock from a thread without a Python thread state, e.g. an Arrow consumer.
+// returns -1 (without an exception) if the calling thread already holds it
+static inline int ConnectionLock_acquire_detached(ConnectionLock* lock) {
+    if (ConnectionLock_held(lock))
+        return -1;
+#if PY_VERSION_HEX >= 0x030D0000
+    PyMutex_Lock(&lock->mutex);
+#else
+    PyThread_acquire_lock(lock->mutex, WAIT_LOCK);
+#endif
+    __atomic_store_n(&lock->owner, PyThread_get_thread_ident(), __ATOMIC_RELAXED);
+    return 0;
+}
+
+// takes the lock, letting other Python threads run while waiting for it. Returns -1 with an exception set
+// if the calling thread already holds it (e.g. a parameter's __str__ using the same connection)
+static inline int ConnectionLock_acquire(ConnectionLock* lock) {
+    if (ConnectionLock_held(lock)) {
+        PyErr_SetString(PyExc_RuntimeError, "the connection is already in use by this thread");
+        return -1;
+    }
+#if PY_VERSION_HEX >= 0x030D0000
+    // PyMutex detaches the thread state while it waits
+    PyMutex_Lock(&lock->mutex);
+#else
+    if (!PyThread_acquire_lock(lock->mutex, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(lock->mutex, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+#endif
+    __atomic_store_n(&lock->owner, PyThread_get_thread_ident(), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static inline void ConnectionLock_release(ConnectionLock* lock) {
+    __atomic_store_n(&lock->owner, 0, __ATOMIC_RELAXED);
+#if PY_VERSION_HEX >= 0x030D0000
+    PyMutex_Unlock(&lock->mutex);
+#else
+    PyThread_release_lock(lock->mutex);
+#endif
+}
+
+#endif
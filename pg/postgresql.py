@@ -1,8 +1,31 @@
 from __future__ import annotations # allow __enter__ to return Connection
+import os
 from types import TracebackType
-from typing import Any
+from typing import Any, AsyncIterator, Iterator
 
 
+class ArrowStream:
+    """Record batches in the Arrow C stream format, e.g. pyarrow.RecordBatchReader.from_stream(stream) or polars.from_arrow(stream).
+    Column types map as bool -> bool, int2/int4/int8 -> int16/int32/int64, float4/float8 -> float32/float64, 
+    everything else -> utf8 (or binary for binary format results).  Can only be consumed once."""
+    def __arrow_c_stream__(self, requested_schema:object|None=None) -> object:
+        raise NotImplementedError()
+
+    def __arrow_c_schema__(self) -> object:
+        raise NotImplementedError()
+
+class Row:
+    """A row of a DataTable.  Holds the table, values are only converted to strings when read"""
+    def __len__(self) -> int:
+        raise NotImplementedError()
+
+    def __getitem__(self, column:int|str|slice) -> str|list[str]:
+        """Gets the value of a column by index or name, or a list of the values of a slice of columns"""
+        raise NotImplementedError()
+
+    def to_list(self) -> list[str]:
+        raise NotImplementedError()
+
 class DataTable:
     """A table of values, a number or rows and columns"""
     def __len__(self) -> int:
@@ -17,7 +40,29 @@ class DataTable:
     def column_index(self, column_name: str) -> int:
         raise NotImplementedError()
 
-    def __getitem__(self, location:tuple[int, int]) -> str:
+    def __getitem__(self, location:tuple[int, int]|int) -> str|Row:
+        """The value at (row, column), or a view of a whole row when indexed by row only (IndexError when out of range)"""
+        raise NotImplementedError()
+
+    def __iter__(self) -> Iterator[Row]:
+        raise NotImplementedError()
+
+    def to_arrow(self, batch_rows:int=65536) -> ArrowStream:
+        """The rows as an Arrow stream of record batches"""
+        raise NotImplementedError()
+
+    def __arrow_c_stream__(self, requested_schema:object|None=None) -> object:
+        """Allows Arrow consumers to read the table directly, e.g. pyarrow.table(data_table)"""
+        raise NotImplementedError()
+
+    def to_dict(self, key_cols:int|str|list[int|str], value_cols:int|str|list[int|str]|None=None) -> dict[Any, Any]:
+        """Maps the key_cols values to the value_cols values, or to the Row when value_cols is not given.
+        A list of columns gives tuples, keys and values are typed (int, float, bool, str) rather than strings.
+        Later rows replace earlier rows with the same key"""
+        raise NotImplementedError()
+
+    def group_index(self, key_col:int|str|list[int|str]) -> dict[Any, list[Row]]:
+        """Maps each key_col value to the list of Rows with that value"""
         raise NotImplementedError()
 
 class ForwardCursor:
@@ -55,6 +100,25 @@ class ForwardCursor:
     def get_str(self, column: int) -> str:
         raise NotImplementedError()
 
+    def to_arrow_batches(self, batch_rows:int=65536) -> ArrowStream:
+        """Reads the remaining rows, starting with the current row if next_row() has been called, as an Arrow stream of record batches"""
+        raise NotImplementedError()
+
+    def aggregate(self, group_by:list[int|str], sums:list[int|str]=(), counts:bool=True) -> dict[str, list]:
+        """Reads the remaining rows, starting with the current row if next_row() has been called, grouped by the group_by columns.
+        Returns the groups as columns: the group_by values, the sum of each sums column (None if every value was NULL)
+        and the number of rows in 'count'.  Integer columns are summed exactly, other columns as float"""
+        raise NotImplementedError()
+
+    def to_dict(self, key_cols:int|str|list[int|str], value_cols:int|str|list[int|str]|None=None) -> dict[Any, Any]:
+        """Reads the remaining rows into a dict of the key_cols values to the value_cols values, or to the whole row as a tuple.
+        A list of columns gives tuples.  Later rows replace earlier rows with the same key"""
+        raise NotImplementedError()
+
+    def group_index(self, key_col:int|str|list[int|str]) -> dict[Any, list[tuple]]:
+        """Reads the remaining rows into a dict of each key_col value to the list of rows (as tuples) with that value"""
+        raise NotImplementedError()
+
     def __getattr__(self, name:str) -> str|None:
         """dynamic access to a column, accessed via the column name"""
         column = self.column_index(name)
@@ -62,18 +126,29 @@ class ForwardCursor:
     
 
 class Connection():
-    """A connection to PostgreSQL"""
+    """A connection to PostgreSQL.  Can be shared between threads, calls are serialised by a per-connection lock
+    that is released while waiting on the network, so threads using separate connections run in parallel"""
 
     def __init__(self, connection_string:str):
         """Opens a new connection to PostgreSQL"""
         raise NotImplementedError()
 
-    def query(self, sql:str, *args: Any) -> DataTable:
-        """Run a SQL query that returns a table of zero or more rows, e.g. SELECT.  The DataTable is buffered into client memory."""
+    @classmethod
+    async def connect(cls, connection_string:str, timeout:float|None=None) -> Connection:
+        """Opens a new connection from an asyncio event loop without blocking it while the handshake runs.
+        A host name is still resolved while blocking, give hostaddr to avoid that"""
         raise NotImplementedError()
 
-    def execute(self, sql:str, *args: Any) -> None:
-        """Run a SQL statement that does not return any rows, e.g. INSERT, UPDATE or DELETE, and wait for the statement to finish."""
+    def query(self, sql:str, *args: Any, timeout:float|None=None, spill_threshold:int|None=None) -> DataTable:
+        """Run a SQL query that returns a table of zero or more rows, e.g. SELECT.  The DataTable is buffered into client memory.
+        If timeout seconds pass the query is cancelled on the server and TimeoutError is raised.
+        With spill_threshold, once the rows take more than that many bytes they are moved to temporary files in TMPDIR
+        that are memory mapped, so the DataTable does not have to fit in memory.  The result is not cached."""
+        raise NotImplementedError()
+
+    def execute(self, sql:str, *args: Any, timeout:float|None=None) -> None:
+        """Run a SQL statement that does not return any rows, e.g. INSERT, UPDATE or DELETE, and wait for the statement to finish.
+        If timeout seconds pass the statement is cancelled on the server and TimeoutError is raised."""
         raise NotImplementedError()
 
     def start_execute(self, sql:str, *args: Any) -> None:
@@ -90,24 +165,59 @@ class Connection():
         """Run a multiple SQL statements, each one must not return any rows."""
         raise NotImplementedError()
 
-    def start_query(self, sql:str, *args: Any, binary_format:bool=False) -> ForwardCursor:
+    def query_to_file(self, sql:str, *args: Any, path:str|os.PathLike[str], format:str='csv', timeout:float|None=None) -> tuple[int, int]:
+        """Writes the rows of a query to path using COPY ... TO STDOUT, format being 'csv', 'text' or 'binary'.
+        The data goes from the network to the file without creating Python objects, using constant memory.
+        Arguments ($1, $2 ...) are inlined as escaped literals because COPY does not take parameters.
+        path is only opened once the server has accepted the query, and it is removed if the copy then fails.
+        Returns (rows, bytes written)."""
+        raise NotImplementedError()
+
+    def start_query(self, sql:str, *args: Any, binary_format:bool=False, timeout:float|None=None) -> ForwardCursor:
         """Sends a SQL query to the server but does not wait for it to finish. 
         Results are accessed via the returned forward-only cursor that does NOT buffer the results, 
-        useful for reading large number of rows."""
+        useful for reading large number of rows.
+        The timeout covers reading every row, after which the cursor cancels the query and raises TimeoutError."""
         raise NotImplementedError()
 
-    def start_copy_in(self, sql:str) -> None:
+    def start_copy(self, sql:str, timeout:float|None=None) -> None:
         """Starts a COPY ... FROM STDIN operation"""
         raise NotImplementedError()
 
-    def write_copy_data(self, data:str) -> None:
+    def put_copy_data(self, data:str) -> None:
         """Sends a block of data to PostgreSQL as part of the COPY ... FROM STDIN operation"""
         raise NotImplementedError()
         
-    def end_copy(self) -> None:
-        """Finishes the COPY operation started by start_copy_in()"""
+    def end_copy(self, timeout:float|None=None) -> None:
+        """Finishes the COPY operation started by start_copy()"""
         raise NotImplementedError()
         
+    def enable_cache(self, max_entries:int=1024, ttl:float=60.0, channel:str|None=None) -> None:
+        """Caches the DataTables returned by query(), keyed by SQL text and parameters, for up to ttl seconds.
+        At most max_entries are kept, the least recently used being evicted first.
+        If channel is given the connection LISTENs on it: a NOTIFY evicts cached queries whose SQL contains the payload
+        (e.g. a table name), an empty payload evicts everything.
+        Only results whose command tag is SELECT, VALUES, SHOW or TABLE are cached, so INSERT/UPDATE/DELETE ... RETURNING
+        are always run. Volatile reads (now(), random(), nextval() in a SELECT) are cached like any other SELECT."""
+        raise NotImplementedError()
+
+    def disable_cache(self) -> None:
+        """Stops caching query() results"""
+        raise NotImplementedError()
+
+    def clear_cache(self) -> None:
+        """Discards every cached query() result"""
+        raise NotImplementedError()
+
+    def notifications(self, timeout:float|None=None) -> list[tuple[str, int, str]]:
+        """Waits up to timeout seconds (forever if None) for notifications from channels this connection has LISTENed on.
+        Returns every pending notification as a list of (channel, pid, payload) tuples, empty if the timeout expired."""
+        raise NotImplementedError()
+
+    def notification_stream(self) -> AsyncIterator[list[tuple[str, int, str]]]:
+        """An async iterator that yields batches of (channel, pid, payload) tuples as they arrive, for use with asyncio"""
+        raise NotImplementedError()
+
     def close(self) -> None:
         """Closes this connection to PostgreSQL"""
         raise NotImplementedError()
@@ -117,3 +227,71 @@ class Connection():
 
     def __exit__(self, exc_type: type[BaseException] | None, exc_val: BaseException | None, traceback: TracebackType | None) -> None:
         self.close()
+
+
+class Router():
+    """Routes statements across a primary and its streaming replicas.  Reads go to the healthy replica with the
+    lowest expected wait (calls in flight times the moving average of its call latency), writes go to the primary.
+    Servers are connected with target_session_attrs (read-write for the primary, standby for replicas), so a
+    server in the wrong role is treated as down.  A replica that goes away is retried after retry_seconds and
+    reads that fail because it went away are run again elsewhere.  Reads fall back to the primary when no replica is up."""
+
+    def __init__(self, primary:str, replicas:list[str]=[], pin_seconds:float=0.0, retry_seconds:float=5.0):
+        """Connects to the primary (which must be up) and each replica.  With pin_seconds, reads go to the primary
+        for that long after a write so they see its changes (read-your-writes)."""
+        raise NotImplementedError()
+
+    def query(self, sql:str, *args: Any, timeout:float|None=None, spill_threshold:int|None=None) -> DataTable:
+        """Connection.query() on a replica"""
+        raise NotImplementedError()
+
+    def query_to_file(self, sql:str, *args: Any, path:str|os.PathLike[str], format:str='csv', timeout:float|None=None) -> tuple[int, int]:
+        """Connection.query_to_file() on a replica"""
+        raise NotImplementedError()
+
+    def start_query(self, sql:str, *args: Any, binary_format:bool=False, timeout:float|None=None) -> None:
+        """Connection.start_query() on a replica, read the rows with end_query() on the same thread.
+        Threads share the router's connections, so another start_query() routed to the same server fails until the rows have been read"""
+        raise NotImplementedError()
+
+    def end_query(self) -> ForwardCursor:
+        """Connection.end_query() for the last start_query() of the calling thread"""
+        raise NotImplementedError()
+
+    def execute(self, sql:str, *args: Any, timeout:float|None=None) -> None:
+        """Connection.execute() on the primary"""
+        raise NotImplementedError()
+
+    def execute_script(self, script:str) -> None:
+        """Connection.execute_script() on the primary"""
+        raise NotImplementedError()
+
+    def start_copy(self, sql:str, timeout:float|None=None) -> None:
+        """Connection.start_copy() on the primary"""
+        raise NotImplementedError()
+
+    def put_copy_data(self, data:str) -> None:
+        """Connection.put_copy_data() on the connection start_copy() used, even if the primary has been reconnected since"""
+        raise NotImplementedError()
+
+    def end_copy(self, timeout:float|None=None) -> None:
+        """Connection.end_copy() on the connection start_copy() used"""
+        raise NotImplementedError()
+
+    def primary(self) -> Connection:
+        """The connection to the primary, e.g. for transactions or LISTEN"""
+        raise NotImplementedError()
+
+    def hosts(self) -> list[tuple[str, str, bool, float, int]]:
+        """(conninfo, 'primary' or 'replica', healthy, latency in seconds, calls in flight) for each server"""
+        raise NotImplementedError()
+
+    def close(self) -> None:
+        """Closes the connections to every server"""
+        raise NotImplementedError()
+
+
+def connect_many(connection_string:str, n:int, timeout:float|None=None) -> list[Connection]:
+    """Opens n connections at once, so the total time is about that of one connection.
+    If any connection fails they are all closed and ConnectionError is raised"""
+    raise NotImplementedError()
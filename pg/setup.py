@@ -1,11 +1,13 @@
-from distutils.core import setup, Extension
+from setuptools import setup, Extension
 
 module1 = Extension(
     'pg', 
     include_dirs=["/usr/include/postgresql"], 
     libraries=["pq"], 
-    sources=["Connection.c", "DataTable.c", "ForwardCursor.c"],    
+    sources=["Connection.c", "DataTable.c", "ForwardCursor.c", "Notifications.c", "QueryCache.c", "Arrow.c", "Router.c", "Aggregate.c", "Lookup.c", "Connect.c", "Spill.c", "decode.c"],    
     extra_link_args=["-flto"],
-    extra_compile_args=["-march=native", "-fno-semantic-interposition"]
+    # no -march=native so the build runs on any CPU, decode.c picks SIMD byte swaps at runtime
+    extra_compile_args=["-fno-semantic-interposition"]
     )
-setup(name="pg", version="1.0", ext_modules=[module1], )
\ No newline at end of file
+# pyarrow is only needed to consume the Arrow streams, e.g. pyarrow.table(data_table), the module does not import it
+setup(name="pg", version="1.0", ext_modules=[module1], extras_require={"arrow": ["pyarrow"]})
\ No newline at end of file
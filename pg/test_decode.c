@@ -0,0 +1,149 @@
+// checks the byte swap kernels and text parsers in decode.c, it is not part of the module:
+//   cc -O2 -I/usr/include/postgresql test_decode.c -lpq -o test_decode && ./test_decode
+// decode.c is included so the kernels the CPU supports can be compared with the scalar swap directly
+#include "decode.c"
+#include <math.h>
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(condition, ...) do { \
+    if (!(condition)) { \
+        failures++; \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+    } \
+} while (0)
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+
+// compares a kernel with the scalar swap for every width, counts 0 to 150 (odd lengths leave a tail
+// for each vector loop) and offsets 0 to 7 from an aligned buffer (unaligned loads and stores)
+static void check_kernel(const char* name, bswap_func kernel) {
+    uint8_t source[8 + 150 * 8 + 8], expected[sizeof(source)], actual[sizeof(source)];
+    for (size_t i = 0; i < sizeof(source); i++)
+        source[i] = (uint8_t)(i * 37 + 11);
+
+    for (int width = 2; width <= 8; width *= 2) {
+        for (size_t count = 0; count <= 150; count++) {
+            for (size_t offset = 0; offset < 8; offset++) {
+                memcpy(expected, source, sizeof(source));
+                memcpy(actual, source, sizeof(source));
+                bswap_scalar(expected + offset, count, width);
+                kernel(actual + offset, count, width);
+                CHECK(memcmp(expected, actual, sizeof(source)) == 0,
+                      "%s width %d count %zu offset %zu differs from scalar", name, width, count, offset);
+            }
+        }
+    }
+}
+
+static void check_bswap(void) {
+    // the scalar swap itself against reversing the bytes of each value
+    uint8_t data[3 * 8];
+    for (int width = 2; width <= 8; width *= 2) {
+        for (size_t i = 0; i < sizeof(data); i++)
+            data[i] = (uint8_t)i;
+        bswap_scalar(data, 3, width);
+        for (int value = 0; value < 3; value++)
+            for (int b = 0; b < width; b++)
+                CHECK(data[value * width + b] == value * width + width - 1 - b, "scalar width %d byte %d", width, b);
+    }
+
+#ifdef DECODE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        check_kernel("ssse3", bswap_ssse3);
+    if (__builtin_cpu_supports("avx2"))
+        check_kernel("avx2", bswap_avx2);
+    if (__builtin_cpu_supports("avx512bw"))
+        check_kernel("avx512", bswap_avx512);
+#endif
+#ifdef DECODE_NEON
+    check_kernel("neon", bswap_neon);
+#endif
+    check_kernel("dispatched", select_bswap());
+}
+
+#else
+
+static void check_bswap(void) {
+}
+
+#endif
+
+static void check_int64(const char* text, int ok, int64_t expected) {
+    int64_t value = 0;
+    int result = parse_int64(text, strlen(text), &value);
+    CHECK(result == (ok ? 0 : -1), "parse_int64(\"%s\") returned %d", text, result);
+    if (ok && result == 0)
+        CHECK(value == expected, "parse_int64(\"%s\") = %lld", text, (long long)value);
+}
+
+static void check_float8(const char* text, int ok, double expected) {
+    double value = 0;
+    int result = parse_float8(text, strlen(text), &value);
+    CHECK(result == (ok ? 0 : -1), "parse_float8(\"%s\") returned %d", text, result);
+    if (ok && result == 0)
+        CHECK(isnan(expected) ? isnan(value) : value == expected && signbit(value) == signbit(expected),
+              "parse_float8(\"%s\") = %.17g", text, value);
+}
+
+static void check_parse(void) {
+    check_int64("0", 1, 0);
+    check_int64("-0", 1, 0);
+    check_int64("+42", 1, 42);
+    check_int64("9223372036854775807", 1, INT64_MAX);
+    check_int64("-9223372036854775808", 1, INT64_MIN);
+    check_int64("9223372036854775808", 0, 0);
+    check_int64("-9223372036854775809", 0, 0);
+    check_int64("99999999999999999999", 0, 0);
+    check_int64("", 0, 0);
+    check_int64("-", 0, 0);
+    check_int64("12a", 0, 0);
+    check_int64("12 ", 0, 0);
+    check_int64(" 12", 0, 0);
+    check_int64("1.5", 0, 0);
+
+    check_float8("0", 1, 0.0);
+    check_float8("-0", 1, -0.0);
+    check_float8("1.5", 1, 1.5);
+    check_float8("-2.25e-3", 1, -2.25e-3);
+    check_float8("1E+22", 1, 1e22);
+    check_float8("1.7976931348623157e+308", 1, 1.7976931348623157e308);
+    check_float8("4.9406564584124654e-324", 1, 4.9406564584124654e-324);
+    check_float8("0.30000000000000004", 1, 0.30000000000000004);
+    check_float8("123456789012345678901234567890", 1, 123456789012345678901234567890.0);
+    check_float8("Infinity", 1, INFINITY);
+    check_float8("-Infinity", 1, -INFINITY);
+    check_float8("NaN", 1, NAN);
+    check_float8("", 0, 0);
+    check_float8("-", 0, 0);
+    check_float8(".", 0, 0);
+    check_float8("1e", 0, 0);
+    check_float8("1e+", 0, 0);
+    check_float8("e5", 0, 0);
+    check_float8("0x1p3", 0, 0);
+    check_float8("inf", 0, 0);
+    check_float8("-inf", 0, 0);
+    check_float8("nan", 0, 0);
+    check_float8("-NaN", 0, 0);
+    check_float8("infinity", 0, 0);
+    check_float8(" 1", 0, 0);
+    check_float8("1 ", 0, 0);
+    check_float8("1,5", 0, 0);
+    check_float8("1.5.2", 0, 0);
+    check_float8("12345678901234567890123e400x", 0, 0);
+}
+
+int main(void) {
+    check_bswap();
+    check_parse();
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}